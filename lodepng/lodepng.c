@@ -206,6 +206,7 @@ typedef struct ucvector
   unsigned char* data;
   size_t size; /*used size*/
   size_t allocsize; /*allocated size*/
+  unsigned fixed; /*if 1, data is owned by the caller and is never reallocated*/
 } ucvector;
 
 /*returns 1 if success, 0 if failure ==> nothing done*/
@@ -213,6 +214,7 @@ static unsigned ucvector_resize(ucvector* p, size_t size)
 {
   if(size * sizeof(unsigned char) > p->allocsize)
   {
+    if(p->fixed) return 0; /*error: the caller's buffer is too small*/
     size_t newsize = size * sizeof(unsigned char) * 2;
     void* data = lodepng_realloc(p->data, newsize);
     if(data)
@@ -240,8 +242,20 @@ static void ucvector_init(ucvector* p)
 {
   p->data = NULL;
   p->size = p->allocsize = 0;
+  p->fixed = 0;
 }
 
+#ifdef LODEPNG_COMPILE_DECODER
+/*use a buffer owned by the caller, that can hold up to allocsize bytes. Don't use cleanup on it*/
+static void ucvector_init_fixed(ucvector* p, unsigned char* buffer, size_t size, size_t allocsize)
+{
+  p->data = buffer;
+  p->size = size;
+  p->allocsize = allocsize;
+  p->fixed = 1;
+}
+#endif /*LODEPNG_COMPILE_DECODER*/
+
 #ifdef LODEPNG_COMPILE_DECODER
 /*resize and give all new elements the value*/
 static unsigned ucvector_resizev(ucvector* p, size_t size, unsigned char value)
@@ -261,6 +275,7 @@ static void ucvector_init_buffer(ucvector* p, unsigned char* buffer, size_t size
 {
   p->data = buffer;
   p->allocsize = p->size = size;
+  p->fixed = 0;
 }
 #endif /*LODEPNG_COMPILE_ZLIB*/
 
@@ -1087,9 +1102,27 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   return error;
 }
 
+/*optional progress report of the inflater, so the start of the output can be used
+while the rest is still being inflated*/
+typedef struct InflateProgress
+{
+  /*gets the bytes inflated so far, returns an error code to stop inflating or 0*/
+  unsigned (*callback)(const unsigned char* out, size_t size, void* user);
+  void* user; /*passed to callback*/
+  size_t step; /*callback is called again once at least step more bytes are inflated*/
+  size_t next; /*output size at which callback is called next*/
+} InflateProgress;
+
+static unsigned inflateReport(InflateProgress* progress, const ucvector* out, size_t pos)
+{
+  progress->next = pos + progress->step;
+  return progress->callback(out->data, pos, progress->user);
+}
+
 /*inflate a block with dynamic of fixed Huffman tree*/
 static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size_t* bp,
-                                    size_t* pos, size_t inlength, unsigned btype)
+                                    size_t* pos, size_t inlength, unsigned btype,
+                                    InflateProgress* progress)
 {
   unsigned error = 0;
   HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
@@ -1104,8 +1137,15 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 
   while(!error) /*decode all symbols until end reached, breaks at end code*/
   {
+    unsigned code_ll;
+    if(progress && (*pos) >= progress->next)
+    {
+      error = inflateReport(progress, out, *pos);
+      if(error) break;
+    }
+
     /*code_ll is literal, length or end code*/
-    unsigned code_ll = huffmanDecodeSymbol(in, bp, &tree_ll, inbitlength);
+    code_ll = huffmanDecodeSymbol(in, bp, &tree_ll, inbitlength);
     if(code_ll <= 255) /*literal symbol*/
     {
       if((*pos) >= out->size)
@@ -1218,9 +1258,11 @@ static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, siz
   return error;
 }
 
+/*progress may be NULL*/
 static unsigned lodepng_inflatev(ucvector* out,
                                  const unsigned char* in, size_t insize,
-                                 const LodePNGDecompressSettings* settings)
+                                 const LodePNGDecompressSettings* settings,
+                                 InflateProgress* progress)
 {
   /*bit pointer in the "in" data, current byte is bp >> 3, current bit is bp & 0x7 (from lsb to msb of the byte)*/
   size_t bp = 0;
@@ -1241,8 +1283,9 @@ static unsigned lodepng_inflatev(ucvector* out,
 
     if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
     else if(BTYPE == 0) error = inflateNoCompression(out, in, &bp, &pos, insize); /*no compression*/
-    else error = inflateHuffmanBlock(out, in, &bp, &pos, insize, BTYPE); /*compression, BTYPE 01 or 10*/
+    else error = inflateHuffmanBlock(out, in, &bp, &pos, insize, BTYPE, progress); /*compression, BTYPE 01 or 10*/
 
+    if(!error && progress && pos >= progress->next) error = inflateReport(progress, out, pos);
     if(error) return error;
   }
 
@@ -1259,26 +1302,12 @@ unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
   unsigned error;
   ucvector v;
   ucvector_init_buffer(&v, *out, *outsize);
-  error = lodepng_inflatev(&v, in, insize, settings);
+  error = lodepng_inflatev(&v, in, insize, settings, NULL);
   *out = v.data;
   *outsize = v.size;
   return error;
 }
 
-static unsigned inflate(unsigned char** out, size_t* outsize,
-                        const unsigned char* in, size_t insize,
-                        const LodePNGDecompressSettings* settings)
-{
-  if(settings->custom_inflate)
-  {
-    return settings->custom_inflate(out, outsize, in, insize, settings);
-  }
-  else
-  {
-    return lodepng_inflate(out, outsize, in, insize, settings);
-  }
-}
-
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -2094,8 +2123,10 @@ static unsigned adler32(const unsigned char* data, unsigned len)
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                                 size_t insize, const LodePNGDecompressSettings* settings)
+/*decompresses into a vector; custom_inflate is not used for fixed vectors. progress may be NULL*/
+static unsigned zlib_decompressv(ucvector* out, const unsigned char* in,
+                                 size_t insize, const LodePNGDecompressSettings* settings,
+                                 InflateProgress* progress)
 {
   unsigned error = 0;
   unsigned CM, CINFO, FDICT;
@@ -2126,19 +2157,35 @@ unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const uns
     return 26;
   }
 
-  error = inflate(out, outsize, in + 2, insize - 2, settings);
+  if(settings->custom_inflate && !out->fixed)
+  {
+    error = settings->custom_inflate(&out->data, &out->size, in + 2, insize - 2, settings);
+  }
+  else error = lodepng_inflatev(out, in + 2, insize - 2, settings, progress);
   if(error) return error;
 
   if(!settings->ignore_adler32)
   {
     unsigned ADLER32 = lodepng_read32bitInt(&in[insize - 4]);
-    unsigned checksum = adler32(*out, (unsigned)(*outsize));
+    unsigned checksum = adler32(out->data, (unsigned)(out->size));
     if(checksum != ADLER32) return 58; /*error, adler checksum not correct, data must be corrupted*/
   }
 
   return 0; /*no error*/
 }
 
+unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
+                                 size_t insize, const LodePNGDecompressSettings* settings)
+{
+  unsigned error;
+  ucvector v;
+  ucvector_init_buffer(&v, *out, *outsize);
+  error = zlib_decompressv(&v, in, insize, settings, NULL);
+  *out = v.data;
+  *outsize = v.size;
+  return error;
+}
+
 static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
                                 size_t insize, const LodePNGDecompressSettings* settings)
 {
@@ -4582,9 +4629,106 @@ static unsigned readChunk_pHYs(LodePNGInfo* info, const unsigned char* data, siz
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
+/*state of decodeStrips while the scanlines are being inflated*/
+typedef struct StripState
+{
+  LodePNGDecodeBuffers* buffers;
+  unsigned h;
+  size_t bytewidth, linebytes;
+  unsigned y; /*next row to unfilter*/
+  unsigned first; /*first row of the strip that isn't handed over yet*/
+} StripState;
+
+/*InflateProgress callback of decodeStrips: unfilters every row whose scanline is complete in the
+size bytes of in, and hands every strip that is done to the buffers' strip_callback*/
+static unsigned unfilterStrips(const unsigned char* in, size_t size, void* user)
+{
+  StripState* strips = (StripState*)user;
+  LodePNGDecodeBuffers* buffers = strips->buffers;
+  unsigned char* out = buffers->image;
+  unsigned rows = buffers->strip_rows ? buffers->strip_rows : strips->h;
+  size_t ready = size / (1 + strips->linebytes);
+
+  if(ready > strips->h) ready = strips->h;
+  for(; strips->y < ready; strips->y++)
+  {
+    unsigned y = strips->y;
+    unsigned char* line = &out[strips->linebytes * y];
+    const unsigned char* prevline = y ? &out[strips->linebytes * (y - 1)] : 0;
+    const unsigned char* scanline = &in[(1 + strips->linebytes) * y]; /*starts with the filter type byte*/
+    CERROR_TRY_RETURN(unfilterScanline(line, &scanline[1], prevline, strips->bytewidth, scanline[0], strips->linebytes));
+
+    if(y + 1 - strips->first == rows || y + 1 == strips->h)
+    {
+      if(buffers->strip_callback) buffers->strip_callback(strips->first, y + 1 - strips->first, out, buffers->strip_user);
+      strips->first = y + 1;
+    }
+  }
+  return 0;
+}
+
+/*inflates idat into scanlines and post processes it into buffers->image, handing every strip of rows to
+the buffers' strip_callback. Images without interlacing or padding bits are unfiltered while they're
+inflated, a strip at a time; the rest is post processed once inflated and handed over as a single strip*/
+static unsigned decodeStrips(LodePNGDecodeBuffers* buffers, ucvector* scanlines, const ucvector* idat,
+                             unsigned w, unsigned h, const LodePNGInfo* info_png,
+                             const LodePNGDecompressSettings* settings)
+{
+  unsigned char* out = buffers->image;
+  unsigned bpp = lodepng_get_bpp(&info_png->color);
+  StripState strips;
+  InflateProgress progress;
+
+  if(bpp == 0) return 31; /*error: invalid colortype*/
+
+  if(info_png->interlace_method != 0 || (w * bpp) % 8 != 0)
+  {
+    /*Adam7_deinterlace and removePaddingBits need the out buffer to be 0*/
+    size_t i, imagesize = lodepng_get_raw_size(w, h, &info_png->color);
+    CERROR_TRY_RETURN(zlib_decompressv(scanlines, idat->data, idat->size, settings, NULL));
+    for(i = 0; i < imagesize; i++) out[i] = 0;
+    CERROR_TRY_RETURN(postProcessScanlines(out, scanlines->data, w, h, info_png));
+    if(buffers->strip_callback) buffers->strip_callback(0, h, out, buffers->strip_user);
+    return 0;
+  }
+
+  strips.buffers = buffers;
+  strips.h = h;
+  strips.bytewidth = (bpp + 7) / 8;
+  strips.linebytes = (w * bpp) / 8;
+  strips.y = strips.first = 0;
+  progress.callback = unfilterStrips;
+  progress.user = &strips;
+  progress.step = (1 + strips.linebytes) * (buffers->strip_rows ? buffers->strip_rows : h);
+  progress.next = progress.step;
+  CERROR_TRY_RETURN(zlib_decompressv(scanlines, idat->data, idat->size, settings, &progress));
+
+  /*the rows after the last report, like postProcessScanlines the whole buffer is used even if
+  the zlib data was shorter*/
+  return unfilterStrips(scanlines->data, (1 + strips.linebytes) * h, &strips);
+}
+
+/*size of the inflated, still filtered scanlines (with their filter type bytes)*/
+static size_t getFilteredSize(unsigned w, unsigned h, const LodePNGInfo* info)
+{
+  unsigned bpp = lodepng_get_bpp(&info->color);
+  if(info->interlace_method == 0)
+  {
+    return (size_t)h * (1 + ((size_t)w * bpp + 7) / 8);
+  }
+  else
+  {
+    unsigned passw[7], passh[7];
+    size_t filter_passstart[8], padded_passstart[8], passstart[8];
+    Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
+    return filter_passstart[7];
+  }
+}
+
 /*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
+/*if buffers is not NULL, its buffers are used instead of allocating new ones, and *out is set to buffers->image*/
 static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
-                          LodePNGState* state,
+                          LodePNGState* state, LodePNGDecodeBuffers* buffers,
                           const unsigned char* in, size_t insize)
 {
   unsigned char IEND = 0;
@@ -4605,7 +4749,8 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   state->error = lodepng_inspect(w, h, state, in, insize); /*reads header and resets other parameters in state->info_png*/
   if(state->error) return;
 
-  ucvector_init(&idat);
+  if(buffers) ucvector_init_fixed(&idat, buffers->idat, 0, buffers->idatsize);
+  else ucvector_init(&idat);
   chunk = &in[33]; /*first byte of the first chunk after the header*/
 
   /*loop through the chunks, ignoring unknown chunks and stopping at IEND chunk.
@@ -4729,6 +4874,20 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     if(!IEND) chunk = lodepng_chunk_next_const(chunk);
   }
 
+  if(buffers)
+  {
+    /*everything goes to the caller's buffers, that must be big enough for this image*/
+    size_t imagesize = lodepng_get_raw_size(*w, *h, &state->info_png.color);
+    ucvector_init_fixed(&scanlines, buffers->scanlines, buffers->scanlinessize, buffers->scanlinessize);
+    if(!state->error && buffers->imagesize < imagesize) state->error = 83; /*alloc fail*/
+    if(!state->error)
+    {
+      state->error = decodeStrips(buffers, &scanlines, &idat, *w, *h, &state->info_png, &state->decoder.zlibsettings);
+      *out = buffers->image;
+    }
+    return;
+  }
+
   ucvector_init(&scanlines);
   if(!state->error)
   {
@@ -4758,12 +4917,33 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   ucvector_cleanup(&scanlines);
 }
 
+void lodepng_decode_buffer_sizes(LodePNGDecodeBuffers* sizes, unsigned w, unsigned h,
+                                 const LodePNGInfo* info, size_t insize)
+{
+  sizes->idatsize = insize; /*the IDAT chunks can't hold more than the whole file*/
+  /*one spare byte: the inflater asks for more room when a match ends exactly at the end of its buffer*/
+  sizes->scanlinessize = getFilteredSize(w, h, info) + 1;
+  sizes->imagesize = lodepng_get_raw_size(w, h, &info->color);
+}
+
+unsigned lodepng_decode_into(LodePNGDecodeBuffers* buffers, unsigned* w, unsigned* h,
+                             LodePNGState* state,
+                             const unsigned char* in, size_t insize)
+{
+  unsigned char* out;
+  decodeGeneric(&out, w, h, state, buffers, in, insize);
+  if(state->error) return state->error;
+  /*no color conversion: info_raw reflects what colortype the image has*/
+  state->error = lodepng_color_mode_copy(&state->info_raw, &state->info_png.color);
+  return state->error;
+}
+
 unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
                         LodePNGState* state,
                         const unsigned char* in, size_t insize)
 {
   *out = 0;
-  decodeGeneric(out, w, h, state, in, insize);
+  decodeGeneric(out, w, h, state, NULL, in, insize);
   if(state->error) return state->error;
   if(!state->decoder.color_convert || lodepng_color_mode_equal(&state->info_raw, &state->info_png.color))
   {
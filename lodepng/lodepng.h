@@ -668,6 +668,50 @@ information is placed in the info_png field of the LodePNGState.
 unsigned lodepng_inspect(unsigned* w, unsigned* h,
                          LodePNGState* state,
                          const unsigned char* in, size_t insize);
+
+/*
+Buffers owned by the caller, for lodepng_decode_into. They can be reused from
+one image to the next, so decoding many images doesn't allocate them again.
+*/
+typedef struct LodePNGDecodeBuffers
+{
+  unsigned char* idat; /*the data of the IDAT chunks, still compressed*/
+  size_t idatsize;
+  unsigned char* scanlines; /*the inflated, still filtered scanlines*/
+  size_t scanlinessize;
+  unsigned char* image; /*the decoded image, in the color type of the PNG*/
+  size_t imagesize;
+  /*
+  Optional, may be NULL. Called in order with every strip of strip_rows rows
+  (the last one may be shorter) as soon as it's inflated and unfiltered, while
+  the rest of the image is still being inflated. image is the whole image
+  buffer. Interlaced images and images with padding bits are only complete at
+  the end, so the callback gets all of their rows at once. A broken checksum
+  is only found at the end: lodepng_decode_into still fails then, but the
+  callback may already have had some strips.
+  */
+  void (*strip_callback)(unsigned y, unsigned rows, const unsigned char* image, void* user);
+  unsigned strip_rows;
+  void* strip_user; /*passed to strip_callback*/
+} LodePNGDecodeBuffers;
+
+/*
+Sets the sizes the buffers must have to decode a PNG of insize bytes whose
+header (w, h and info) was read with lodepng_inspect. The pointers are untouched.
+*/
+void lodepng_decode_buffer_sizes(LodePNGDecodeBuffers* sizes, unsigned w, unsigned h,
+                                 const LodePNGInfo* info, size_t insize);
+
+/*
+Same as lodepng_decode with color_convert disabled, but inflates, unfilters and
+deinterlaces into the given buffers instead of allocating new ones. The image
+ends up in buffers->image. Returns error 83 if a buffer is too small. The
+custom_zlib and custom_inflate settings are not used. The pointers and
+strip_callback fields are used, the sizes must be big enough for this PNG.
+*/
+unsigned lodepng_decode_into(LodePNGDecodeBuffers* buffers, unsigned* w, unsigned* h,
+                             LodePNGState* state,
+                             const unsigned char* in, size_t insize);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 
@@ -0,0 +1,216 @@
+/*****************************************************************************
+**	arena.c
+**
+**	Arena (bump) allocator for the PNGB graphics converter.
+**	Every allocation done during a conversion (including the ones LodePNG
+**	does internally) comes from the job arena, which is reset in one go once
+**	the output has been written. The blocks are kept around so the next job
+**	can reuse them without going back to the heap.
+**
+** 	Copyright (c) 2015 Elias Zacarias
+**
+** 	Permission is hereby granted, free of charge, to any person obtaining a
+** 	copy of this software and associated documentation files (the "Software"),
+** 	to deal in the Software without restriction, including without limitation
+** 	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+** 	and/or sell copies of the Software, and to permit persons to whom the
+** 	Software is furnished to do so, subject to the following conditions:
+**
+** 	The above copyright notice and this permission notice shall be included in
+** 	all copies or substantial portions of the Software.
+
+** 	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** 	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** 	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** 	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** 	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+** 	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+** 	IN THE SOFTWARE.
+**
+*****************************************************************************/
+#include "pngb.h"
+
+#define ARENA_ALIGN_UP(n)	(((n) + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1))
+#define ARENA_HDR_SIZE		ARENA_ALIGN_UP(sizeof(ARENA_HEADER))
+#define ARENA_BLK_SIZE		ARENA_ALIGN_UP(sizeof(ARENA_BLOCK))
+
+/* Every allocation is preceded by this header. It lets us find the block an
+allocation belongs to, and how much room it has to grow in place. */
+typedef struct{
+	ARENA_BLOCK *block;			/* Block that holds this allocation.                                    */
+	size_t capacity;			/* Usable bytes after the header.                                       */
+}ARENA_HEADER;
+
+/* The arena every conversion job allocates from. */
+ARENA jobArena;
+
+/*###########################################################################
+ ##                                                                        ##
+ ##                     A U X    F U N C T I O N S                         ##
+ ##                                                                        ##
+ ###########################################################################*/
+/*** block_data *************************************************************
+ * Returns the first usable byte of an arena block.                         *
+ ****************************************************************************/
+static BYTE *block_data(ARENA_BLOCK *blk){
+	return (BYTE *)blk + ARENA_BLK_SIZE;
+}
+
+/*** header_of **************************************************************
+ * Returns the header of an allocation returned by arena_alloc().           *
+ ****************************************************************************/
+static ARENA_HEADER *header_of(void *ptr){
+	return (ARENA_HEADER *)((BYTE *)ptr - ARENA_HDR_SIZE);
+}
+
+/*** is_last_alloc **********************************************************
+ * Returns non-zero if 'hdr' is the most recent allocation of its block,    *
+ * which means it can grow or be released in place.                         *
+ ****************************************************************************/
+static int is_last_alloc(ARENA_HEADER *hdr){
+	return ((BYTE *)hdr + ARENA_HDR_SIZE + hdr->capacity == block_data(hdr->block) + hdr->block->used);
+}
+
+/*** new_block **************************************************************
+ * Requests a new block from the heap and appends it to the arena.          *
+ ****************************************************************************/
+static ARENA_BLOCK *new_block(ARENA *a, size_t min_size){
+	size_t size = (min_size > ARENA_BLOCK_SIZE ? min_size : ARENA_BLOCK_SIZE);
+	ARENA_BLOCK *blk = (ARENA_BLOCK *)malloc(ARENA_BLK_SIZE + size);
+	ARENA_BLOCK *last;
+
+	if (!blk) error ("ERROR: Out of memory (requested %lu bytes).", (unsigned long)size);
+	blk->owner	= a;
+	blk->next	= NULL;
+	blk->size	= size;
+	blk->used	= 0;
+
+	if (!a->blocks){
+		a->blocks = blk;
+	}else {
+		for (last = a->blocks; last->next; last = last->next);
+		last->next = blk;
+	}
+	a->reserved += size;
+	return blk;
+}
+
+/*###########################################################################
+ ##                                                                        ##
+ ##                    A R E N A   A L L O C A T I O N                     ##
+ ##                                                                        ##
+ ###########################################################################*/
+/*** arena_alloc ************************************************************
+ * Returns 'size' bytes from the arena. Never returns NULL; aborts instead. *
+ ****************************************************************************/
+void *arena_alloc(ARENA *a, size_t size){
+	size_t need = ARENA_HDR_SIZE + ARENA_ALIGN_UP(size);
+	ARENA_BLOCK *blk = a->current;
+	ARENA_HEADER *hdr;
+
+	/* Blocks are reused in order after a reset, so we only ever look forward
+	from the current one. Whatever is left at the end of a block is wasted. */
+	while (blk && blk->used + need > blk->size) blk = blk->next;
+	if (!blk) blk = new_block(a, need);
+	a->current = blk;
+
+	hdr = (ARENA_HEADER *)(block_data(blk) + blk->used);
+	hdr->block		= blk;
+	hdr->capacity	= need - ARENA_HDR_SIZE;
+	blk->used		+= need;
+
+	a->in_use += need;
+	if (a->in_use > a->peak) a->peak = a->in_use;
+	return (BYTE *)hdr + ARENA_HDR_SIZE;
+}
+
+/*** arena_realloc **********************************************************
+ * Resizes an arena allocation. Grows in place whenever possible.           *
+ ****************************************************************************/
+void *arena_realloc(ARENA *a, void *ptr, size_t new_size){
+	ARENA_HEADER *hdr;
+	ARENA_BLOCK *blk;
+	size_t extra;
+	void *moved;
+
+	if (!ptr) return arena_alloc(a, new_size);
+
+	hdr = header_of(ptr);
+	if (new_size <= hdr->capacity) return ptr;
+
+	/* Growing the last allocation of a block only needs to bump the block */
+	blk = hdr->block;
+	extra = ARENA_ALIGN_UP(new_size) - hdr->capacity;
+	if (is_last_alloc(hdr) && blk->used + extra <= blk->size){
+		blk->used		+= extra;
+		hdr->capacity	+= extra;
+		blk->owner->in_use += extra;
+		if (blk->owner->in_use > blk->owner->peak) blk->owner->peak = blk->owner->in_use;
+		return ptr;
+	}
+
+	moved = arena_alloc(a, new_size);
+	memcpy (moved, ptr, hdr->capacity);
+	arena_free (ptr);
+	return moved;
+}
+
+/*** arena_free *************************************************************
+ * "Frees" an arena allocation. Only the most recent allocation of a block  *
+ * is actually given back; everything else waits for arena_reset().         *
+ ****************************************************************************/
+void arena_free(void *ptr){
+	ARENA_HEADER *hdr;
+	size_t size;
+
+	if (!ptr) return;
+	hdr = header_of(ptr);
+	if (!is_last_alloc(hdr)) return;
+
+	size = ARENA_HDR_SIZE + hdr->capacity;
+	hdr->block->used -= size;
+	hdr->block->owner->in_use -= size;
+}
+
+/*** arena_reset ************************************************************
+ * Releases every allocation in the arena at once, keeping the blocks so    *
+ * the next job can reuse them.                                             *
+ ****************************************************************************/
+void arena_reset(ARENA *a){
+	ARENA_BLOCK *blk;
+	for (blk = a->blocks; blk; blk = blk->next) blk->used = 0;
+	a->current	= a->blocks;
+	a->in_use	= 0;
+}
+
+/*** arena_release **********************************************************
+ * Gives every block of the arena back to the heap.                         *
+ ****************************************************************************/
+void arena_release(ARENA *a){
+	ARENA_BLOCK *next, *blk = a->blocks;
+	while (blk){
+		next = blk->next;
+		free (blk);
+		blk = next;
+	}
+	memset ((void *)a, 0, sizeof(ARENA));
+}
+
+/*###########################################################################
+ ##                                                                        ##
+ ##              L O D E P N G   A L L O C A T O R   H O O K S             ##
+ ##                                                                        ##
+ ###########################################################################*/
+/* LodePNG is compiled with LODEPNG_NO_COMPILE_ALLOCATORS, so these are the
+functions it will use for all of its internal buffers. */
+void *lodepng_malloc(size_t size){
+	return arena_alloc(&jobArena, size);
+}
+
+void *lodepng_realloc(void *ptr, size_t new_size){
+	return arena_realloc(&jobArena, ptr, new_size);
+}
+
+void lodepng_free(void *ptr){
+	arena_free(ptr);
+}
@@ -0,0 +1,407 @@
+/*****************************************************************************
+**	banks.c
+**
+**	ROM bank placement for the PNGB graphics converter.
+**	Data that doesn't have to live in the home bank is registered here as
+**	"assets". Assets bigger than a ROM bank are split into chunks (at tile or
+**	row boundaries), then every chunk is placed in a switchable bank using a
+**	first-fit-decreasing bin packer. Chunks that belong to the same group are
+**	kept together in one bank whenever they fit.
+**
+**	The registered data outlives the job arena on purpose, so several jobs
+**	can be packed together into the same set of banks. When a run converts
+**	more than one image (see bank_share), every job adds its data to the
+**	same registry, and gbdk_shared_banks_output() packs all of it and writes
+**	one set of bank files and one index after the last job.
+**
+** 	Copyright (c) 2015 Elias Zacarias
+**
+** 	Permission is hereby granted, free of charge, to any person obtaining a
+** 	copy of this software and associated documentation files (the "Software"),
+** 	to deal in the Software without restriction, including without limitation
+** 	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+** 	and/or sell copies of the Software, and to permit persons to whom the
+** 	Software is furnished to do so, subject to the following conditions:
+**
+** 	The above copyright notice and this permission notice shall be included in
+** 	all copies or substantial portions of the Software.
+
+** 	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** 	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** 	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** 	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** 	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+** 	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+** 	IN THE SOFTWARE.
+**
+*****************************************************************************/
+#include "pngb.h"
+
+/* Something the packer has to place: a group of chunks or a lone chunk. */
+typedef struct{
+	size_t size;				/* Bytes needed in the bank.                                            */
+	int chunk;					/* First chunk of the unit.                                             */
+	int group;					/* Group of the unit (0 for a lone chunk).                              */
+}BANK_UNIT;
+
+static BANK_ASSET *assets	= NULL;
+static BANK_CHUNK *chunks	= NULL;
+static int assetCount		= 0;
+static int chunkCount		= 0;
+static int groupCount		= 0;
+static int firstBank		= 0;
+static int lastBank			= -1;
+
+/* Set by bank_share(): the jobs of the run share one set of banks */
+static int sharedBanks		= 0;
+/* Jobs that placed data in the shared banks, and the lowest -bank they gave */
+static int sharedJobs		= 0;
+static int sharedFirst		= 0;
+/* Where the shared bank files go: next to the output of the first job */
+static char sharedDir[1024]	= "";
+
+/*###########################################################################
+ ##                                                                        ##
+ ##                     A U X    F U N C T I O N S                         ##
+ ##                                                                        ##
+ ###########################################################################*/
+/*** add_chunk **************************************************************
+ * Appends a copy of 'size' bytes of 'data' to the chunk list.              *
+ ****************************************************************************/
+static void add_chunk(const char *symbol, const BYTE *data, size_t size, int asset, int group){
+	BANK_CHUNK *c;
+
+	chunks = (BANK_CHUNK *)realloc(chunks, (chunkCount+1)*sizeof(BANK_CHUNK));
+	if (!chunks) error ("ERROR: Out of memory.");
+	c = &chunks[chunkCount++];
+	snprintf (c->symbol, sizeof(c->symbol), "%s", symbol);
+	c->data		= (BYTE *)malloc(size ? size : 1);
+	if (!c->data) error ("ERROR: Out of memory.");
+	memcpy (c->data, data, size);
+	c->size		= size;
+	c->asset	= asset;
+	c->group	= group;
+	c->bank		= -1;
+}
+
+/*** compare_units **********************************************************
+ * qsort() callback; biggest units first, registration order on ties so the *
+ * output doesn't depend on the qsort implementation.                       *
+ ****************************************************************************/
+static int compare_units(const void *a, const void *b){
+	const BANK_UNIT *ua = (const BANK_UNIT *)a;
+	const BANK_UNIT *ub = (const BANK_UNIT *)b;
+	if (ua->size != ub->size) return (ua->size > ub->size ? -1 : 1);
+	return ua->chunk - ub->chunk;
+}
+
+/*** group_size *************************************************************
+ * Returns the total size of the chunks in a group.                         *
+ ****************************************************************************/
+static size_t group_size(int group){
+	size_t size = 0;
+	int c;
+	for (c=0; c<chunkCount; c++) if (chunks[c].group == group) size += chunks[c].size;
+	return size;
+}
+
+/*** bank_index_defines_output **********************************************
+ * Outputs the pngb_bank_chunk type and the name_bank/_chunk/_chunks        *
+ * defines of every asset to 'decl'.                                        *
+ ****************************************************************************/
+static void bank_index_defines_output(const char *name, FILE *decl){
+	int a;
+
+	fputs ("#ifndef __PNGB_BANK_CHUNK\n", decl);
+	fputs ("#define __PNGB_BANK_CHUNK\n", decl);
+	fputs ("/* ROM bank, address and size of a piece of data that lives in a switchable bank. */\n", decl);
+	fputs ("typedef struct {\n", decl);
+	fputs ("\tunsigned char bank;\n", decl);
+	fputs ("\tconst unsigned char *data;\n", decl);
+	fputs ("\tunsigned int size;\n", decl);
+	fputs ("} pngb_bank_chunk;\n", decl);
+	fputs ("#endif\n\n", decl);
+
+	for (a=0; a<assetCount; a++){
+		fprintf (decl, "#define %s_bank\t%d\n", assets[a].symbol, chunks[assets[a].first_chunk].bank);
+		fprintf (decl, "#define %s_chunk\t%d\n", assets[a].symbol, assets[a].first_chunk);
+		fprintf (decl, "#define %s_chunks\t%d\n", assets[a].symbol, assets[a].chunks);
+	}
+	fprintf (decl, "#define %s_chunk_count\t%d\n\n", name, chunkCount);
+}
+
+/*** bank_index_table_output ************************************************
+ * Outputs the name_chunks[] table with the bank, address and size of every *
+ * chunk.                                                                   *
+ ****************************************************************************/
+static void bank_index_table_output(const char *name, FILE *f){
+	int c;
+
+	gbdk_decl_output (f, "const pngb_bank_chunk %s_chunks[]", name);
+	fputs (" = {", f);
+	for (c=0; c<chunkCount; c++){
+		fprintf (f, "\n\t{ %d, %s, %lu }", chunks[c].bank, chunks[c].symbol, (unsigned long)chunks[c].size);
+		if (c < chunkCount-1) fputs (",", f);
+	}
+	fputs ("\n};\n\n", f);
+}
+
+/*###########################################################################
+ ##                                                                        ##
+ ##                      B A N K   P L A C E M E N T                       ##
+ ##                                                                        ##
+ ###########################################################################*/
+/*** bank_new_group *********************************************************
+ * Returns a new group id for assets that should share a bank.              *
+ ****************************************************************************/
+int bank_new_group(void){
+	return ++groupCount;
+}
+
+/*** bank_add_asset *********************************************************
+ * Registers 'size' bytes of data to be placed in a ROM bank. If it doesn't *
+ * fit in one, it's split in chunks that are a multiple of 'unit' bytes (if *
+ * 'unit' is 0 the data can't be split). Returns the asset index.           *
+ ****************************************************************************/
+int bank_add_asset(const char *symbol, const BYTE *data, size_t size, size_t unit, int group){
+	BANK_ASSET *a;
+	char name[280];
+	size_t step, ofs;
+	int n;
+
+	/* Shared banks hold the data of every job, so the names can't repeat */
+	for (n=0; n<assetCount; n++){
+		if (!strcmp(assets[n].symbol, symbol)) error ("ERROR: %s[] is already in a ROM bank. Jobs that share the banks need their own -name (see -manifest).", symbol);
+	}
+	assets = (BANK_ASSET *)realloc(assets, (assetCount+1)*sizeof(BANK_ASSET));
+	if (!assets) error ("ERROR: Out of memory.");
+	a = &assets[assetCount];
+	snprintf (a->symbol, sizeof(a->symbol), "%s", symbol);
+	a->first_chunk = chunkCount;
+
+	if (size <= ROM_BANK_SIZE){
+		add_chunk (symbol, data, size, assetCount, group);
+	}else {
+		if (!unit || unit > ROM_BANK_SIZE) error ("ERROR: %s[] is %lu bytes long and doesn't fit in a ROM bank.", symbol, (unsigned long)size);
+		/* Split chunks can't be kept with the rest of their group */
+		step = (ROM_BANK_SIZE / unit) * unit;
+		for (ofs=0; ofs<size; ofs+=step){
+			snprintf (name, sizeof(name), "%s_%d", symbol, chunkCount - a->first_chunk);
+			add_chunk (name, &data[ofs], MIN(step, size - ofs), assetCount, 0);
+		}
+	}
+	a->chunks = chunkCount - a->first_chunk;
+	return assetCount++;
+}
+
+/*** bank_pack **************************************************************
+ * Places every chunk in a ROM bank, starting from bank 'first'. Uses first *
+ * fit decreasing: the biggest unit goes first into the lowest bank that    *
+ * still has room. Returns the last bank used. Aborts if the data doesn't   *
+ * fit below ROM_BANK_LAST, as the generated code couldn't switch to it.    *
+ ****************************************************************************/
+int bank_pack(int first){
+	BANK_UNIT *units = (BANK_UNIT *)arena_alloc(&jobArena, chunkCount*sizeof(BANK_UNIT));
+	size_t *freeSpace = (size_t *)arena_alloc(&jobArena, chunkCount*sizeof(size_t));
+	int c, g, u, b, unitCount = 0, banks = 0;
+
+	/* Build the list of units; a group is a single unit if it fits in a bank */
+	for (c=0; c<chunkCount; c++){
+		g = chunks[c].group;
+		if (g){
+			for (u=0; u<unitCount && units[u].group != g; u++);
+			if (u < unitCount) continue;
+			if (group_size(g) <= ROM_BANK_SIZE){
+				units[unitCount].size	= group_size(g);
+				units[unitCount].chunk	= c;
+				units[unitCount++].group= g;
+				continue;
+			}
+		}
+		units[unitCount].size	= chunks[c].size;
+		units[unitCount].chunk	= c;
+		units[unitCount++].group= 0;
+	}
+	qsort (units, unitCount, sizeof(BANK_UNIT), compare_units);
+
+	for (u=0; u<unitCount; u++){
+		for (b=0; b<banks && freeSpace[b] < units[u].size; b++);
+		if (b == banks) freeSpace[banks++] = ROM_BANK_SIZE;
+		freeSpace[b] -= units[u].size;
+
+		if (units[u].group){
+			for (c=0; c<chunkCount; c++) if (chunks[c].group == units[u].group) chunks[c].bank = first + b;
+		}else {
+			chunks[units[u].chunk].bank = first + b;
+		}
+	}
+
+	for (b=0; b<banks; b++) verbose ("-- ROM bank %d: %lu bytes used, %lu free\n", first + b, (unsigned long)(ROM_BANK_SIZE - freeSpace[b]), (unsigned long)freeSpace[b]);
+	if (first + banks - 1 > ROM_BANK_LAST) error ("ERROR: The data takes ROM banks %d to %d, but SWITCH_ROM_MBC1() only reaches bank %d.\n\tStart from a lower bank (-bank) or convert less data at once.", first, first + banks - 1, ROM_BANK_LAST);
+	arena_free (freeSpace);
+	arena_free (units);
+
+	firstBank	= first;
+	lastBank	= first + banks - 1;
+	return lastBank;
+}
+
+/*** bank_share *************************************************************
+ * Makes the jobs that follow add their data to the same set of banks,      *
+ * which is packed and written once the last one is done (see               *
+ * gbdk_shared_banks_output), instead of each job packing its own.          *
+ ****************************************************************************/
+void bank_share(void){
+	sharedBanks = 1;
+}
+
+/*** bank_shared ************************************************************
+ * Tells if the jobs of the run share one set of banks.                     *
+ ****************************************************************************/
+int bank_shared(void){
+	return sharedBanks;
+}
+
+/*** bank_share_job *********************************************************
+ * Notes a job that placed its data in the shared banks. The bank files go  *
+ * next to the output of the first one, and packing starts from the lowest  *
+ * first bank any of them asked for.                                        *
+ ****************************************************************************/
+void bank_share_job(const char *outputfile, int first){
+	const char *c, *name = outputfile;
+
+	if (!sharedJobs){
+		for (c=outputfile; *c; c++) if (*c == '/' || *c == '\\') name = c + 1;
+		snprintf (sharedDir, sizeof(sharedDir), "%.*s", (int)(name - outputfile), outputfile);
+	}
+	if (!sharedJobs || first < sharedFirst) sharedFirst = first;
+	sharedJobs++;
+}
+
+/*** bank_shared_jobs *******************************************************
+ * Returns how many jobs have placed data in the shared banks so far.       *
+ ****************************************************************************/
+int bank_shared_jobs(void){
+	return sharedJobs;
+}
+
+/*** bank_index_name ********************************************************
+ * Returns the prefix of the name_chunks[] table the output code reads the  *
+ * chunks from: the job's own, or the one shared by the whole run.          *
+ ****************************************************************************/
+const char *bank_index_name(void){
+	return (sharedBanks ? BANK_SHARED_NAME : globalOpts.name);
+}
+
+/*** bank_reset *************************************************************
+ * Forgets every asset registered so far.                                   *
+ ****************************************************************************/
+void bank_reset(void){
+	int c;
+	for (c=0; c<chunkCount; c++) free (chunks[c].data);
+	free (chunks);
+	free (assets);
+	chunks		= NULL;
+	assets		= NULL;
+	chunkCount	= 0;
+	assetCount	= 0;
+	groupCount	= 0;
+	lastBank	= -1;
+	sharedJobs	= 0;
+}
+
+/*###########################################################################
+ ##                                                                        ##
+ ##                     O U T P U T   G E N E R A T I O N                  ##
+ ##                                                                        ##
+ ###########################################################################*/
+/*** gbdk_bank_externs_output ***********************************************
+ * Declares the arrays of an asset, which are defined in the bank files.    *
+ ****************************************************************************/
+void gbdk_bank_externs_output(int asset, FILE *f){
+	int c;
+	BANK_ASSET *a = &assets[asset];
+	f = gbdk_decl_file(f);
+	for (c=a->first_chunk; c<a->first_chunk+a->chunks; c++){
+		fprintf (f, "extern const unsigned char %s[];\n", chunks[c].symbol);
+	}
+	fputs ("\n", f);
+}
+
+/*** gbdk_bank_index_output *************************************************
+ * Outputs where every asset ended up: a name_bank/_chunk/_chunks define    *
+ * per asset and a table with the bank, address and size of every chunk.    *
+ ****************************************************************************/
+void gbdk_bank_index_output(const char *name, FILE *f){
+	bank_index_defines_output (name, gbdk_decl_file(f));
+	bank_index_table_output (name, f);
+}
+
+/*** gbdk_shared_banks_output ***********************************************
+ * Packs the data every job of the run placed in the shared banks, and      *
+ * writes the bank files (pngb_banks_b<N>.c) and the index the outputs of   *
+ * all of them include (pngb_banks.h, with its table in pngb_banks.c).      *
+ ****************************************************************************/
+void gbdk_shared_banks_output(void){
+	char codefile[1024], headerfile[1024], source[64];
+	FILE *f, *h;
+	int c;
+
+	if (!sharedJobs) return;
+	snprintf (codefile, sizeof(codefile), "%s%s.c", sharedDir, BANK_SHARED_NAME);
+	snprintf (headerfile, sizeof(headerfile), "%s%s.h", sharedDir, BANK_SHARED_NAME);
+	snprintf (source, sizeof(source), "ROM banks of %d jobs", sharedJobs);
+
+	verbose ("\n<PACKING ROM BANKS OF %d JOBS>\n", sharedJobs);
+	bank_pack (sharedFirst);
+	gbdk_bank_files_output (source, codefile);
+
+	h = fopen(headerfile, "w");
+	if (!h) error ("ERROR: Couldn't create file %s", headerfile);
+	f = fopen(codefile, "w");
+	if (!f) error ("ERROR: Couldn't create file %s", codefile);
+	verbose ("-- Writing the bank index to %s and %s\n", codefile, headerfile);
+
+	code_disclaimer_c (source, headerfile, h);
+	fprintf (h, "#ifndef __PNGB_%s_H\n#define __PNGB_%s_H\n\n", BANK_SHARED_NAME, BANK_SHARED_NAME);
+	bank_index_defines_output (BANK_SHARED_NAME, h);
+	for (c=0; c<chunkCount; c++) fprintf (h, "extern const unsigned char %s[];\n", chunks[c].symbol);
+	fprintf (h, "extern const pngb_bank_chunk %s_chunks[];\n\n#endif\n", BANK_SHARED_NAME);
+
+	code_disclaimer_c (source, codefile, f);
+	fprintf (f, "#include \"%s.h\"\n\n", BANK_SHARED_NAME);
+	bank_index_table_output (BANK_SHARED_NAME, f);
+	fclose (f);
+	fclose (h);
+}
+
+/*** gbdk_bank_files_output *************************************************
+ * Writes one C file per ROM bank next to 'outputfile' (out_b<N>.c), each   *
+ * one holding the chunks placed in that bank.                              *
+ ****************************************************************************/
+void gbdk_bank_files_output(char *inputfile, char *outputfile){
+	char filename[1024], *ext;
+	size_t baselen;
+	int b, c;
+	FILE *f;
+
+	ext = strrchr(outputfile, '.');
+	if (ext && (strchr(ext, '/') || strchr(ext, '\\'))) ext = NULL;
+	baselen = (ext ? (size_t)(ext - outputfile) : strlen(outputfile));
+
+	for (b=firstBank; b<=lastBank; b++){
+		snprintf (filename, sizeof(filename), "%.*s_b%d%s", (int)baselen, outputfile, b, (ext ? ext : ""));
+		f = fopen(filename, "w");
+		if (!f) error ("ERROR: Couldn't create file %s", filename);
+		verbose ("-- Writing bank %d to %s\n", b, filename);
+
+		code_disclaimer_c (inputfile, filename, f);
+		fprintf (f, "#pragma bank %d\n\n", b);
+		for (c=0; c<chunkCount; c++){
+			if (chunks[c].bank != b) continue;
+			fprintf (f, "const unsigned char %s[] = {", chunks[c].symbol);
+			c_byte_array_output (chunks[c].data, chunks[c].size, f);
+		}
+		fclose (f);
+	}
+}
@@ -0,0 +1,247 @@
+/*****************************************************************************
+**	check.c
+**
+**	Preflight check for the PNGB graphics converter.
+**	Validates a list of PNG files (or whole directories of them) against the
+**	current options without converting them. Only the IHDR and PLTE chunks
+**	are read; the image data is never inflated, so checking a large asset
+**	tree only takes a few milliseconds per file.
+**
+** 	Copyright (c) 2015 Elias Zacarias
+**
+** 	Permission is hereby granted, free of charge, to any person obtaining a
+** 	copy of this software and associated documentation files (the "Software"),
+** 	to deal in the Software without restriction, including without limitation
+** 	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+** 	and/or sell copies of the Software, and to permit persons to whom the
+** 	Software is furnished to do so, subject to the following conditions:
+**
+** 	The above copyright notice and this permission notice shall be included in
+** 	all copies or substantial portions of the Software.
+
+** 	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** 	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** 	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** 	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** 	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+** 	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+** 	IN THE SOFTWARE.
+**
+*****************************************************************************/
+#include <dirent.h>
+#include <sys/stat.h>
+#include "lodepng.h"
+#include "pngb.h"
+
+#define CHECK_HEADER_SIZE	33		/* PNG signature plus the IHDR chunk */
+
+/* Results of a check run */
+typedef struct{
+	int files;					/* Files checked.                                                       */
+	int failed;					/* Files that can't be converted.                                       */
+	int warned;					/* Files that can be converted, but with warnings.                      */
+}CHECK_TOTALS;
+
+/* Problems found in the file being checked */
+static int fileErrors, fileWarnings;
+
+/*###########################################################################
+ ##                                                                        ##
+ ##                     A U X    F U N C T I O N S                         ##
+ ##                                                                        ##
+ ###########################################################################*/
+/*** check_report ***********************************************************
+ * Prints a problem found in a file. 'is_error' tells if it prevents the    *
+ * file from being converted at all.                                        *
+ ****************************************************************************/
+static void check_report(const char *filename, int is_error, const char *format, ...){
+	va_list args;
+
+	if (is_error) fileErrors++;
+	else fileWarnings++;
+
+	printf ("%s: %s: ", filename, (is_error ? "ERROR" : "WARNING"));
+	va_start (args, format);
+	vprintf (format, args);
+	va_end (args);
+	printf ("\n");
+}
+
+/*** compare_names **********************************************************
+ * qsort() callback that sorts directory entries by name.                   *
+ ****************************************************************************/
+static int compare_names(const void *a, const void *b){
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/*** read_palette_size ******************************************************
+ * Walks the chunk headers that follow IHDR, skipping their data, until it  *
+ * finds PLTE. Returns the number of palette entries, or -1 if the image    *
+ * data starts (or the file ends) before a palette is found.                *
+ ****************************************************************************/
+static int read_palette_size(FILE *f){
+	BYTE chunk[8];
+	unsigned int length;
+
+	while (fread(chunk, 1, 8, f) == 8){
+		length = lodepng_chunk_length(chunk);
+		if (lodepng_chunk_type_equals(chunk, "PLTE")) return length / 3;
+		if (lodepng_chunk_type_equals(chunk, "IDAT") || lodepng_chunk_type_equals(chunk, "IEND")) break;
+		/* Skip the data and the CRC */
+		if (fseek(f, (long)length + 4, SEEK_CUR)) break;
+	}
+	return -1;
+}
+
+/*###########################################################################
+ ##                                                                        ##
+ ##                       P R E F L I G H T   C H E C K                    ##
+ ##                                                                        ##
+ ###########################################################################*/
+/*** check_png **************************************************************
+ * Checks the conditions process_image() and gb_check_warnings() would      *
+ * complain about, from the header and palette of a PNG.                    *
+ ****************************************************************************/
+static void check_png(const char *filename, CHECK_TOTALS *totals){
+	BYTE header[CHECK_HEADER_SIZE];
+	LodePNGState state;
+	unsigned int w, h, err;
+	int colors = 0, cols, rows, tiles, tileh = (is8x16Mode() ? 16 : 8);
+	int streamed = (globalOpts.stream_slots && globalOpts.type == TARGET_BKG);
+	FILE *f = fopen(filename, "rb");
+
+	fileErrors = fileWarnings = 0;
+	totals->files++;
+	if (!f){
+		check_report (filename, 1, "Couldn't open the file");
+		totals->failed++;
+		return;
+	}
+
+	lodepng_state_init (&state);
+	if (fread(header, 1, CHECK_HEADER_SIZE, f) != CHECK_HEADER_SIZE){
+		err = 27; /* the same error lodepng gives for files too small to be a PNG */
+	}else {
+		err = lodepng_inspect(&w, &h, &state, header, CHECK_HEADER_SIZE);
+	}
+
+	if (err){
+		check_report (filename, 1, "%u: %s", err, lodepng_error_text(err));
+	}else if (state.info_png.color.colortype != LCT_PALETTE){
+		check_report (filename, 1, "PNG colortype 3 (indexed, 256 colors max) expected!");
+	}else {
+		colors = read_palette_size(f);
+		if (colors < 0) check_report (filename, 1, "The PNG has no palette (PLTE chunk) before the image data");
+		else if (colors > 4 && !globalOpts.grayscale) check_report (filename, 1, "PNG has more than 4 colors (%d)! Select grayscale conversion (-g) and try again.", colors);
+	}
+	lodepng_state_cleanup (&state);
+	arena_reset (&jobArena);
+	fclose (f);
+
+	if (!err){
+		if (globalOpts.rect_w){
+			if (globalOpts.rect_x + globalOpts.rect_w > (int)w || globalOpts.rect_y + globalOpts.rect_h > (int)h){
+				check_report (filename, 1, "The region %dx%d at %d,%d is outside of the picture (%ux%u).", globalOpts.rect_w, globalOpts.rect_h, globalOpts.rect_x, globalOpts.rect_y, w, h);
+			}
+			w = globalOpts.rect_w;
+			h = globalOpts.rect_h;
+		}
+		cols = (w + 7) / 8;
+		rows = (h + tileh - 1) / tileh;
+		tiles = cols*rows;
+
+		if (w % 8 || h % tileh) check_report (filename, 0, "The picture (%ux%u) is not a multiple of 8x%d pixels and will be padded", w, h, tileh);
+
+		if (globalOpts.frame_w){
+			if (globalOpts.frame_w % 8 || globalOpts.frame_h % tileh) check_report (filename, 1, "The frame size must be a multiple of 8x%d pixels.", tileh);
+			else if (w % globalOpts.frame_w || h % globalOpts.frame_h) check_report (filename, 1, "The picture (%ux%u) can't be evenly divided in %dx%d frames.", w, h, globalOpts.frame_w, globalOpts.frame_h);
+			else {
+				cols = globalOpts.frame_w / 8;
+				rows = globalOpts.frame_h / tileh;
+			}
+		}
+
+		/* Without converting, the tile count is only known before reduction.
+		Streamed maps (-slots) only need the tiles around the camera to fit.
+		Tile indexes are a byte, so the tiles must fit from the base index up
+		to 255 (8x16 tiles take two indexes each), as gb_check_warnings()
+		expects. */
+		if (streamed){
+			verbose ("%s: %d tiles streamed through %d VRAM slots\n", filename, tiles, globalOpts.stream_slots);
+		}else if (globalOpts.vram_bank1 && globalOpts.type != TARGET_SPRITE){
+			/* -V gives BG tiles the same 256 indexes in both GBC VRAM banks */
+			if (tiles > 2*(256 - globalOpts.baseindex)) check_report (filename, 0, "%d tiles%s at base index %d; VRAM banks 0 and 1 only hold %d", tiles, (globalOpts.tile_reduction ? " (before tile reduction)" : ""), globalOpts.baseindex, 2*(256 - globalOpts.baseindex));
+		}else if (tiles > (256 - globalOpts.baseindex)/(tileh/8)){
+			check_report (filename, 0, "%d tiles%s at base index %d; only %d fit in VRAM from there", tiles, (globalOpts.tile_reduction ? " (before tile reduction)" : ""), globalOpts.baseindex, (256 - globalOpts.baseindex)/(tileh/8));
+		}
+
+		if (globalOpts.test_code){
+			if (globalOpts.type != TARGET_SPRITE){
+				if (!globalOpts.large_map && (cols > 32 || rows > 32)) check_report (filename, 0, "The image is more than 32x32 tiles in size. Try the large map mode (-L).");
+			}else if (!globalOpts.metasprite && (cols*rows > 40 || cols > 10)){
+				check_report (filename, 0, "The picture is more than 40 sprites in size or more than 10 sprites wide.");
+			}
+		}
+
+		verbose ("%s: %ux%u, %d colors, %d tiles%s\n", filename, w, h, colors, tiles, (globalOpts.tile_reduction ? " before reduction" : ""));
+	}
+
+	if (fileErrors) totals->failed++;
+	else if (fileWarnings) totals->warned++;
+}
+
+/*** check_path *************************************************************
+ * Checks a file, or every PNG in a directory and its subdirectories (in    *
+ * name order, so the report is always the same).                           *
+ ****************************************************************************/
+static void check_path(const char *path, CHECK_TOTALS *totals){
+	struct stat st;
+	struct dirent *entry;
+	char **names = NULL, *child;
+	int count = 0, n;
+	DIR *dir;
+
+	if (stat(path, &st) || !S_ISDIR(st.st_mode)){
+		check_png (path, totals);
+		return;
+	}
+
+	dir = opendir(path);
+	if (!dir){
+		printf ("%s: ERROR: Couldn't read the directory\n", path);
+		return;
+	}
+	while ((entry = readdir(dir))){
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+		names = (char **)realloc(names, (count + 1)*sizeof(char *));
+		child = (char *)malloc(strlen(path) + strlen(entry->d_name) + 2);
+		if (!names || !child) error ("ERROR: Out of memory.");
+		sprintf (child, "%s/%s", path, entry->d_name);
+		names[count++] = child;
+	}
+	closedir (dir);
+
+	qsort (names, count, sizeof(char *), compare_names);
+	for (n=0; n<count; n++){
+		/* Inside directories, only the PNG files are checked */
+		if (!stat(names[n], &st) && S_ISDIR(st.st_mode)) check_path (names[n], totals);
+		else if (has_extension(names[n], ".png")) check_png (names[n], totals);
+		free (names[n]);
+	}
+	free (names);
+}
+
+/*** preflight_check ********************************************************
+ * Checks every file or directory in 'paths' and prints a summary. Returns  *
+ * the number of files that can't be converted.                             *
+ ****************************************************************************/
+int preflight_check(char **paths, int count){
+	CHECK_TOTALS totals;
+	int n;
+
+	memset (&totals, 0, sizeof(CHECK_TOTALS));
+	for (n=0; n<count; n++) check_path (paths[n], &totals);
+
+	printf ("-- %d files checked: %d OK, %d with warnings, %d with errors\n", totals.files, totals.files - totals.warned - totals.failed, totals.warned, totals.failed);
+	return totals.failed;
+}
@@ -0,0 +1,325 @@
+/*****************************************************************************
+**	compress.c
+**
+**	LZ compressor for the PNGB graphics converter.
+**	The format is a small LZ77 variant designed to be cheap to decode on the
+**	GB CPU. 2bpp tile data repeats a lot at distances of 1 (solid rows), 2
+**	(repeated rows) and 16 (repeated tiles), so matches have a short form
+**	with a one byte offset besides the regular two byte one.
+**
+**	Stream format (one token byte followed by its arguments):
+**		0x00        End of stream.
+**		0x01-0x7F   Literal run. The next N bytes are copied as they are.
+**		0x80-0xBF   Short match. Length (t & 0x3F) + 2, then one byte with
+**		            the offset minus one (1..256).
+**		0xC0-0xFF   Long match. Length (t & 0x3F) + 3, then the offset
+**		            (1..65535) as a 16-bit little endian word.
+**
+** 	Copyright (c) 2015 Elias Zacarias
+**
+** 	Permission is hereby granted, free of charge, to any person obtaining a
+** 	copy of this software and associated documentation files (the "Software"),
+** 	to deal in the Software without restriction, including without limitation
+** 	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+** 	and/or sell copies of the Software, and to permit persons to whom the
+** 	Software is furnished to do so, subject to the following conditions:
+**
+** 	The above copyright notice and this permission notice shall be included in
+** 	all copies or substantial portions of the Software.
+
+** 	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** 	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** 	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** 	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** 	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+** 	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+** 	IN THE SOFTWARE.
+**
+*****************************************************************************/
+#include "pngb.h"
+
+#define LZ_MAX_LITERALS		127
+#define LZ_SHORT_MIN		2
+#define LZ_SHORT_MAX		65
+#define LZ_SHORT_OFFSET		256
+#define LZ_LONG_MIN			3
+#define LZ_LONG_MAX			66
+#define LZ_LONG_OFFSET		65535
+#define LZ_HASH_SIZE		65536
+#define LZ_NIL				((unsigned int)-1)
+
+/* How many previous occurrences of a 2-byte prefix we are willing to look at
+for every position. The greedy level is meant to be fast; the optimal one
+wants as many candidate matches as it can get. */
+#define LZ_GREEDY_DEPTH		64
+#define LZ_OPTIMAL_DEPTH	1024
+
+/* Best matches found at a given position. */
+typedef struct{
+	unsigned int short_len;		/* Longest match with an offset <= 256 (0 if none).                     */
+	unsigned int short_off;
+	unsigned int long_len;		/* Longest match with any offset (0 if none).                           */
+	unsigned int long_off;
+}LZ_MATCH;
+
+/* Hash chains over the 2-byte prefix of every position. */
+typedef struct{
+	unsigned int *head;
+	unsigned int *prev;
+}LZ_CHAINS;
+
+/*###########################################################################
+ ##                                                                        ##
+ ##                     A U X    F U N C T I O N S                         ##
+ ##                                                                        ##
+ ###########################################################################*/
+/*** lz_hash ****************************************************************
+ * Hash of the 2 bytes starting at 'p'.                                     *
+ ****************************************************************************/
+static unsigned int lz_hash(const BYTE *p){
+	return ((unsigned int)p[0] << 8) | p[1];
+}
+
+/*** lz_build_chains ********************************************************
+ * Links every position with the previous one sharing its 2-byte prefix.    *
+ ****************************************************************************/
+static void lz_build_chains(LZ_CHAINS *ch, const BYTE *src, size_t len){
+	size_t i;
+	unsigned int h;
+
+	ch->head = (unsigned int *)arena_alloc(&jobArena, LZ_HASH_SIZE*sizeof(unsigned int));
+	ch->prev = (unsigned int *)arena_alloc(&jobArena, (len ? len : 1)*sizeof(unsigned int));
+	for (h=0; h<LZ_HASH_SIZE; h++) ch->head[h] = LZ_NIL;
+
+	for (i=0; i+1<len; i++){
+		h = lz_hash(&src[i]);
+		ch->prev[i] = ch->head[h];
+		ch->head[h] = i;
+	}
+	if (len) ch->prev[len-1] = LZ_NIL;
+}
+
+/*** lz_find_matches ********************************************************
+ * Walks the hash chain of position 'pos' looking for the longest short and *
+ * long form matches.                                                       *
+ ****************************************************************************/
+static void lz_find_matches(LZ_CHAINS *ch, const BYTE *src, size_t len, size_t pos, int depth, LZ_MATCH *m){
+	unsigned int cand, off, l, maxl;
+
+	memset ((void *)m, 0, sizeof(LZ_MATCH));
+	if (pos+1 >= len) return;
+
+	maxl = (len - pos < LZ_LONG_MAX ? len - pos : LZ_LONG_MAX);
+	for (cand = ch->prev[pos]; cand != LZ_NIL && depth > 0; cand = ch->prev[cand], depth--){
+		off = pos - cand;
+		if (off > LZ_LONG_OFFSET) break;
+		/* The chain guarantees the first 2 bytes are equal. Matches are allowed
+		to overlap the bytes being decoded (that's how runs are encoded). */
+		for (l=2; l<maxl && src[cand+l] == src[pos+l]; l++);
+
+		if (off <= LZ_SHORT_OFFSET && l > m->short_len){
+			m->short_len = MIN(l, LZ_SHORT_MAX);
+			m->short_off = off;
+		}
+		if (l > m->long_len){
+			m->long_len = l;
+			m->long_off = off;
+		}
+		if (l == maxl && off <= LZ_SHORT_OFFSET) break;
+	}
+	if (m->long_len < LZ_LONG_MIN) m->long_len = 0;
+}
+
+/*** lz_put_literals ********************************************************
+ * Writes a literal run, splitting it in as many tokens as required.        *
+ ****************************************************************************/
+static size_t lz_put_literals(BYTE *dst, const BYTE *src, size_t count){
+	size_t n, out = 0;
+	while (count){
+		n = MIN(count, LZ_MAX_LITERALS);
+		dst[out++] = (BYTE)n;
+		memcpy (&dst[out], src, n);
+		out += n;
+		src += n;
+		count -= n;
+	}
+	return out;
+}
+
+/*** lz_put_match ***********************************************************
+ * Writes a single match token. Picks the short form if it's possible.      *
+ ****************************************************************************/
+static size_t lz_put_match(BYTE *dst, unsigned int len, unsigned int off){
+	if (off <= LZ_SHORT_OFFSET && len <= LZ_SHORT_MAX){
+		dst[0] = 0x80 | (len - LZ_SHORT_MIN);
+		dst[1] = (BYTE)(off - 1);
+		return 2;
+	}
+	dst[0] = 0xC0 | (len - LZ_LONG_MIN);
+	dst[1] = off & 0xff;
+	dst[2] = (off >> 8) & 0xff;
+	return 3;
+}
+
+/*###########################################################################
+ ##                                                                        ##
+ ##                      P A R S I N G   L E V E L S                       ##
+ ##                                                                        ##
+ ###########################################################################*/
+/*** lz_greedy **************************************************************
+ * Greedy parse: always takes the match that saves the most bytes right now.*
+ ****************************************************************************/
+static size_t lz_greedy(const BYTE *src, size_t len, BYTE *dst){
+	LZ_CHAINS ch;
+	LZ_MATCH m;
+	size_t pos = 0, lit_start = 0, out = 0;
+	int short_gain, long_gain;
+
+	lz_build_chains(&ch, src, len);
+	while (pos < len){
+		lz_find_matches(&ch, src, len, pos, LZ_GREEDY_DEPTH, &m);
+		short_gain	= (m.short_len ? (int)m.short_len - 2 : 0);
+		long_gain	= (m.long_len ? (int)m.long_len - 3 : 0);
+
+		if (short_gain <= 0 && long_gain <= 0){
+			pos++;
+			continue;
+		}
+		out += lz_put_literals(&dst[out], &src[lit_start], pos - lit_start);
+		if (short_gain >= long_gain){
+			out += lz_put_match(&dst[out], m.short_len, m.short_off);
+			pos += m.short_len;
+		}else {
+			out += lz_put_match(&dst[out], m.long_len, m.long_off);
+			pos += m.long_len;
+		}
+		lit_start = pos;
+	}
+	out += lz_put_literals(&dst[out], &src[lit_start], pos - lit_start);
+	dst[out++] = 0;
+
+	arena_free(ch.prev);
+	arena_free(ch.head);
+	return out;
+}
+
+/*** lz_optimal *************************************************************
+ * Optimal parse: finds the cheapest sequence of tokens for the whole input *
+ * (under this format) working backwards from the end of the data.          *
+ ****************************************************************************/
+static size_t lz_optimal(const BYTE *src, size_t len, BYTE *dst){
+	LZ_CHAINS ch;
+	LZ_MATCH m;
+	size_t *cost		= (size_t *)arena_alloc(&jobArena, (len+1)*sizeof(size_t));
+	unsigned int *step	= (unsigned int *)arena_alloc(&jobArena, (len+1)*sizeof(unsigned int));
+	unsigned int *off	= (unsigned int *)arena_alloc(&jobArena, (len+1)*sizeof(unsigned int));
+	size_t pos, c, out = 0;
+	unsigned int l, maxl;
+	long i;
+
+	lz_build_chains(&ch, src, len);
+	cost[len] = 0;
+	for (i=(long)len-1; i>=0; i--){
+		pos = (size_t)i;
+		/* Literal run of 'l' bytes. off = 0 marks a literal step. */
+		cost[pos] = (size_t)-1;
+		maxl = MIN(len - pos, LZ_MAX_LITERALS);
+		for (l=1; l<=maxl; l++){
+			c = 1 + l + cost[pos+l];
+			if (c < cost[pos]){
+				cost[pos] = c;
+				step[pos] = l;
+				off[pos] = 0;
+			}
+		}
+		/* Any prefix of a match is a match too, so try every usable length */
+		lz_find_matches(&ch, src, len, pos, LZ_OPTIMAL_DEPTH, &m);
+		for (l=LZ_SHORT_MIN; l<=m.short_len; l++){
+			c = 2 + cost[pos+l];
+			if (c < cost[pos]){
+				cost[pos] = c;
+				step[pos] = l;
+				off[pos] = m.short_off;
+			}
+		}
+		for (l=LZ_LONG_MIN; l<=m.long_len; l++){
+			c = 3 + cost[pos+l];
+			if (c < cost[pos]){
+				cost[pos] = c;
+				step[pos] = l;
+				off[pos] = m.long_off;
+			}
+		}
+	}
+
+	for (pos=0; pos<len; pos+=step[pos]){
+		if (off[pos]){
+			out += lz_put_match(&dst[out], step[pos], off[pos]);
+		}else {
+			out += lz_put_literals(&dst[out], &src[pos], step[pos]);
+		}
+	}
+	dst[out++] = 0;
+
+	arena_free(ch.prev);
+	arena_free(ch.head);
+	arena_free(off);
+	arena_free(step);
+	arena_free(cost);
+	return out;
+}
+
+/*###########################################################################
+ ##                                                                        ##
+ ##                     P U B L I C   F U N C T I O N S                    ##
+ ##                                                                        ##
+ ###########################################################################*/
+/*** lz_bound ***************************************************************
+ * Worst case size of the compressed version of 'len' bytes.                *
+ ****************************************************************************/
+size_t lz_bound(size_t len){
+	return len + len/LZ_MAX_LITERALS + 2;
+}
+
+/*** lz_compress ************************************************************
+ * Compresses 'len' bytes from 'src' into 'dst', which must be at least     *
+ * lz_bound(len) bytes long. Returns the size of the compressed stream,     *
+ * including its terminator.                                                *
+ ****************************************************************************/
+size_t lz_compress(const BYTE *src, size_t len, BYTE *dst, int level){
+	if (level >= LZ_LEVEL_OPTIMAL) return lz_optimal(src, len, dst);
+	return lz_greedy(src, len, dst);
+}
+
+/*** gbdk_lz_decoder_output *************************************************
+ * Outputs the GBDK C code that decompresses the streams above. It's        *
+ * guarded so several converted files can be included in the same program.  *
+ ****************************************************************************/
+void gbdk_lz_decoder_output(FILE *f){
+	fputs ("\n#ifndef __PNGB_UNLZ\n", f);
+	fputs ("#define __PNGB_UNLZ\n", f);
+	fputs ("/* Decompresses PNGB LZ data into 'dst'. Returns the end of the decompressed data. */\n", f);
+	fputs ("unsigned char *pngb_unlz(unsigned char *dst, const unsigned char *src) {\n", f);
+	fputs ("\tunsigned char t, n;\n", f);
+	fputs ("\tunsigned int off;\n", f);
+	fputs ("\tconst unsigned char *from;\n\n", f);
+	fputs ("\twhile ((t = *src++) != 0) {\n", f);
+	fputs ("\t\tif (t < 0x80) {\n", f);
+	fputs ("\t\t\tdo { *dst++ = *src++; } while (--t);\n", f);
+	fputs ("\t\t\tcontinue;\n", f);
+	fputs ("\t\t}\n", f);
+	fputs ("\t\tif (t < 0xC0) {\n", f);
+	fputs ("\t\t\tn = (t & 0x3F) + 2;\n", f);
+	fputs ("\t\t\toff = (unsigned int)(*src++) + 1;\n", f);
+	fputs ("\t\t} else {\n", f);
+	fputs ("\t\t\tn = (t & 0x3F) + 3;\n", f);
+	fputs ("\t\t\toff = src[0] | ((unsigned int)src[1] << 8);\n", f);
+	fputs ("\t\t\tsrc += 2;\n", f);
+	fputs ("\t\t}\n", f);
+	fputs ("\t\tfrom = dst - off;\n", f);
+	fputs ("\t\tdo { *dst++ = *from++; } while (--n);\n", f);
+	fputs ("\t}\n", f);
+	fputs ("\treturn dst;\n", f);
+	fputs ("}\n", f);
+	fputs ("#endif\n", f);
+}
@@ -0,0 +1,271 @@
+/*****************************************************************************
+**	incremental.c
+**
+**	Incremental rebuilds for the PNGB graphics converter.
+**	The tile set and tilemap of every run are kept in a sidecar file. The
+**	next run compares each 8x8 (or 8x16) map cell with what the sidecar says
+**	it held: unchanged cells keep their tile, and only the cells that were
+**	edited are deduplicated again. New tiles go into slots nothing uses any
+**	more (or at the end), so an edit never moves the other tiles.
+**
+**	The changes can also be written to a delta file, so a running game (or
+**	an emulator hot-reload script) can patch VRAM instead of reloading the
+**	whole tile set.
+**
+**	Sidecar layout (all numbers little endian):
+**		8 bytes		"PNGBINC1"
+**		4 bytes		bytes per tile (16 for 8x8 tiles, 32 for 8x16 tiles)
+**		4 bytes		map width in tiles
+**		4 bytes		map height in tiles
+**		4 bytes		tile count
+**		...			the tiles, in index order
+**		...			the map, 4 bytes per cell
+**
+**	Delta layout:
+**		8 bytes		"PNGBDLT1"
+**		4 bytes		bytes per tile
+**		4 bytes		base tile index (-base)
+**		4 bytes		changed tile count
+**		4 bytes		changed map cell count
+**		...			changed tiles: 4 byte tile index, then the tile data
+**		...			changed cells: 4 byte cell index, then 4 byte tile index
+**	Tile indexes don't include the base index; in 8x16 mode each tile takes
+**	two VRAM tiles. Without a usable sidecar every tile and cell "changed".
+**
+** 	Copyright (c) 2015 Elias Zacarias
+**
+** 	Permission is hereby granted, free of charge, to any person obtaining a
+** 	copy of this software and associated documentation files (the "Software"),
+** 	to deal in the Software without restriction, including without limitation
+** 	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+** 	and/or sell copies of the Software, and to permit persons to whom the
+** 	Software is furnished to do so, subject to the following conditions:
+**
+** 	The above copyright notice and this permission notice shall be included in
+** 	all copies or substantial portions of the Software.
+
+** 	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** 	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** 	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** 	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** 	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+** 	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+** 	IN THE SOFTWARE.
+**
+*****************************************************************************/
+#include "pngb.h"
+
+#define SIDECAR_MAGIC		"PNGBINC1"
+#define SIDECAR_HEADER_SIZE	24
+#define DELTA_MAGIC			"PNGBDLT1"
+#define DELTA_HEADER_SIZE	24
+
+/* What the previous run left in the sidecar. Lives in the job arena; it's
+only kept from incremental_reduction() to incremental_save(). */
+static int prevLoaded				= 0;
+static unsigned int prevCount		= 0;
+static BYTE *prevTiles				= NULL;
+static unsigned int *prevMap		= NULL;
+static BYTE *rewritten				= NULL;
+
+/*###########################################################################
+ ##                                                                        ##
+ ##                     A U X    F U N C T I O N S                         ##
+ ##                                                                        ##
+ ###########################################################################*/
+/*** find_tile_slot *********************************************************
+ * Returns the index slot that holds 'data', or the empty slot where it     *
+ * would go, in a hash index of the tiles in 'tiles'.                       *
+ ****************************************************************************/
+static unsigned int find_tile_slot(const BYTE *tiles, unsigned int tilesize, unsigned int *index, unsigned int mask, const BYTE *data){
+	unsigned int h = hash_tile_data(data, tilesize) & mask;
+	while (index[h] != TILE_EMPTY && memcmp(&tiles[index[h]*tilesize], data, tilesize)) h = (h+1) & mask;
+	return h;
+}
+
+/*** load_sidecar ***********************************************************
+ * Loads the tiles and map of the previous run. Returns 0 if there's no     *
+ * sidecar yet, or if it was made for a picture of another size or mode.    *
+ ****************************************************************************/
+static int load_sidecar(const char *filename, PICDATA *pic){
+	BYTE header[SIDECAR_HEADER_SIZE];
+	unsigned int c, tdatasize = pic->tileh*2, mapsize = pic->cols*pic->rows;
+	FILE *f = fopen(filename, "rb");
+
+	prevLoaded = 0;
+	if (!f) return 0;
+	if (fread(header, 1, SIDECAR_HEADER_SIZE, f) != SIDECAR_HEADER_SIZE || memcmp(header, SIDECAR_MAGIC, 8)) error ("ERROR: %s is not a PNGB incremental build file.", filename);
+	if (read_le32(&header[8]) != tdatasize || read_le32(&header[12]) != (unsigned int)pic->cols || read_le32(&header[16]) != (unsigned int)pic->rows){
+		verbose ("-- %s was made for a %ux%u map of %u byte tiles; rebuilding everything\n", filename, read_le32(&header[12]), read_le32(&header[16]), read_le32(&header[8]));
+		fclose (f);
+		return 0;
+	}
+
+	prevCount	= read_le32(&header[20]);
+	prevTiles	= (BYTE *)arena_alloc(&jobArena, (prevCount ? prevCount : 1)*tdatasize);
+	prevMap		= (unsigned int *)arena_alloc(&jobArena, mapsize*sizeof(unsigned int));
+	if (fread(prevTiles, tdatasize, prevCount, f) != prevCount) error ("ERROR: %s is truncated.", filename);
+	for (c=0; c<mapsize; c++){
+		if (fread(header, 1, 4, f) != 4) error ("ERROR: %s is truncated.", filename);
+		prevMap[c] = read_le32(header);
+		if (prevMap[c] >= prevCount) error ("ERROR: %s is damaged (map cell %u uses tile %u of %u).", filename, c, prevMap[c], prevCount);
+	}
+	fclose (f);
+	prevLoaded = 1;
+	return 1;
+}
+
+/*** write_delta ************************************************************
+ * Writes the tiles and map cells that changed since the previous run.      *
+ ****************************************************************************/
+static void write_delta(PICDATA *pic, const char *filename){
+	BYTE header[DELTA_HEADER_SIZE];
+	unsigned int t, c, tiles = 0, cells = 0, tdatasize = pic->tileh*2, mapsize = pic->cols*pic->rows;
+	FILE *f;
+
+	for (t=0; t<(unsigned int)pic->total_tiles; t++) if (!prevLoaded || rewritten[t]) tiles++;
+	for (c=0; c<mapsize; c++) if (!prevLoaded || pic->tilemap[c] != prevMap[c]) cells++;
+
+	memcpy (header, DELTA_MAGIC, 8);
+	write_le32 (&header[8], tdatasize);
+	write_le32 (&header[12], globalOpts.baseindex);
+	write_le32 (&header[16], tiles);
+	write_le32 (&header[20], cells);
+
+	f = fopen(filename, "wb");
+	if (!f) error ("ERROR: Couldn't create file %s", filename);
+	fwrite (header, 1, DELTA_HEADER_SIZE, f);
+	for (t=0; t<(unsigned int)pic->total_tiles; t++){
+		if (prevLoaded && !rewritten[t]) continue;
+		write_le32 (header, t);
+		fwrite (header, 1, 4, f);
+		fwrite (&pic->tiles[t*tdatasize], 1, tdatasize, f);
+	}
+	for (c=0; c<mapsize; c++){
+		if (prevLoaded && pic->tilemap[c] == prevMap[c]) continue;
+		write_le32 (header, c);
+		write_le32 (&header[4], pic->tilemap[c]);
+		fwrite (header, 1, 8, f);
+	}
+	fclose (f);
+	verbose ("-- %u tiles and %u map cells written to %s\n", tiles, cells, filename);
+}
+
+/*###########################################################################
+ ##                                                                        ##
+ ##                 I N C R E M E N T A L   R E B U I L D S                ##
+ ##                                                                        ##
+ ###########################################################################*/
+/*** incremental_reduction **************************************************
+ * Reduces the tiles of a freshly packed picture (one tile per map cell)    *
+ * against the previous run. Returns 0, without touching the picture, if    *
+ * there's no usable sidecar and a full tile reduction is needed instead.   *
+ ****************************************************************************/
+int incremental_reduction(PICDATA *pic, const char *filename){
+	unsigned int t, c, h, slots = 1, capacity, count, nextFree = 0, dirty = 0, moved = 0;
+	unsigned int tdatasize = pic->tileh*2, mapsize = pic->cols*pic->rows;
+	unsigned int *index, *uses, *tilemap;
+	BYTE *tiles, *data;
+
+	if (!load_sidecar(filename, pic)) return 0;
+
+	/* Worst case, every cell brings a new tile */
+	capacity	= prevCount + mapsize;
+	while (slots < 2*capacity) slots <<= 1;
+	/* The tiles and 'rewritten' outlive this function; the rest is freed
+	on the way out, in reverse order (see arena_free) */
+	tiles		= (BYTE *)arena_alloc(&jobArena, capacity*tdatasize);
+	rewritten	= (BYTE *)arena_alloc(&jobArena, capacity);
+	uses		= (unsigned int *)arena_alloc(&jobArena, capacity*sizeof(unsigned int));
+	index		= (unsigned int *)arena_alloc(&jobArena, slots*sizeof(unsigned int));
+	tilemap		= (unsigned int *)arena_alloc(&jobArena, mapsize*sizeof(unsigned int));
+	memcpy (tiles, prevTiles, prevCount*tdatasize);
+	memset (uses, 0, capacity*sizeof(unsigned int));
+	memset (rewritten, 0, capacity);
+	for (h=0; h<slots; h++) index[h] = TILE_EMPTY;
+	for (t=0; t<prevCount; t++){
+		h = find_tile_slot(tiles, tdatasize, index, slots - 1, &tiles[t*tdatasize]);
+		if (index[h] == TILE_EMPTY) index[h] = t;
+	}
+
+	/*	Unchanged cells keep their tile. Changed ones first look for their
+		new contents among the tiles already in VRAM. */
+	for (c=0; c<mapsize; c++){
+		data = &pic->tiles[pic->tilemap[c]*tdatasize];
+		if (!memcmp(data, &tiles[prevMap[c]*tdatasize], tdatasize)){
+			tilemap[c] = prevMap[c];
+		}else {
+			dirty++;
+			h = find_tile_slot(tiles, tdatasize, index, slots - 1, data);
+			tilemap[c] = index[h];
+			if (tilemap[c] == TILE_EMPTY) continue;
+		}
+		uses[tilemap[c]]++;
+	}
+
+	/*	Tiles nobody had are placed in the slots that are no longer used
+		(the old data there can't match any cell, or it would have been
+		picked above), or at the end of the set. */
+	count = prevCount;
+	for (c=0; c<mapsize; c++){
+		if (tilemap[c] != TILE_EMPTY) continue;
+		data = &pic->tiles[pic->tilemap[c]*tdatasize];
+		h = find_tile_slot(tiles, tdatasize, index, slots - 1, data);
+		if (index[h] == TILE_EMPTY){
+			while (nextFree < count && uses[nextFree]) nextFree++;
+			if (nextFree == count) count++;
+			t = nextFree++;
+			memcpy (&tiles[t*tdatasize], data, tdatasize);
+			rewritten[t] = 1;
+			index[h] = t;
+			moved++;
+		}
+		tilemap[c] = index[h];
+		uses[tilemap[c]]++;
+	}
+	while (count && !uses[count-1]) count--;
+
+	pic->tiles = tiles;
+	pic->total_tiles = count;
+	memcpy (pic->tilemap, tilemap, mapsize*sizeof(unsigned int));
+	arena_free (tilemap);
+	arena_free (index);
+	arena_free (uses);
+	verbose ("-- %u of %u map cells changed since the last run, %u tiles rewritten. Tile count: %u\n", dirty, mapsize, moved, count);
+	return 1;
+}
+
+/*** incremental_save *******************************************************
+ * Writes the delta (if requested) and saves the final tiles and map of the *
+ * picture as the sidecar for the next run.                                 *
+ ****************************************************************************/
+void incremental_save(PICDATA *pic, const char *filename){
+	BYTE header[SIDECAR_HEADER_SIZE];
+	unsigned int c, mapsize = pic->cols*pic->rows;
+	FILE *f;
+
+	if (globalOpts.delta_file[0]) write_delta (pic, globalOpts.delta_file);
+
+	memcpy (header, SIDECAR_MAGIC, 8);
+	write_le32 (&header[8], pic->tileh*2);
+	write_le32 (&header[12], pic->cols);
+	write_le32 (&header[16], pic->rows);
+	write_le32 (&header[20], pic->total_tiles);
+
+	f = fopen(filename, "wb");
+	if (!f) error ("ERROR: Couldn't write the incremental build file %s", filename);
+	fwrite (header, 1, SIDECAR_HEADER_SIZE, f);
+	fwrite (pic->tiles, pic->tileh*2, pic->total_tiles, f);
+	for (c=0; c<mapsize; c++){
+		write_le32 (header, pic->tilemap[c]);
+		fwrite (header, 1, 4, f);
+	}
+	fclose (f);
+
+	/* The previous run's data was in the job arena, which is about to go */
+	prevLoaded	= 0;
+	prevCount	= 0;
+	prevTiles	= NULL;
+	prevMap		= NULL;
+	rewritten	= NULL;
+}
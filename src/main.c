@@ -24,8 +24,26 @@
 ** 	IN THE SOFTWARE.
 ** 	
 *****************************************************************************/
+#include <ctype.h>
+#include <sys/stat.h>
+#include <time.h>
 #include "pngb.h"
 
+/* An entry of a manifest file: one conversion with its own options. */
+typedef struct{
+	char *line;					/* Copy of the manifest line; the file names point into it.             */
+	int lineno;					/* Line of the manifest it came from.                                   */
+	char *input;				/* PNG to convert.                                                      */
+	char *output;				/* Output file.                                                         */
+	OPTIONS opts;				/* Command line options plus the ones given in the entry.               */
+	int stale;					/* Set to != 0 if the output has to be (re)built.                       */
+}MANIFEST_ENTRY;
+
+/* Manifest given with -manifest (NULL if none) */
+char *manifestFile = NULL;
+/* Set to != 0 by -check: the files are only checked, not converted */
+int checkOnly = 0;
+
 /*###########################################################################
  ##                                                                        ##
  ##                        M I S C   F U N C T I O N S                     ##
@@ -39,6 +57,8 @@ void reset_opts(){
 
 	globalOpts.type = TARGET_BKG;
 	globalOpts.baseindex = 1;
+	globalOpts.lz_level = LZ_LEVEL_GREEDY;
+	globalOpts.vblank_tiles = VBLANK_CPU_TILES;
 	strcpy(globalOpts.name, "gbpic");
 }
 
@@ -60,6 +80,17 @@ void check_for_enough_args(char *requested_by, int cur_ndx, int total_args){
 	if (cur_ndx >= total_args) error ("Insufficient data for option %s", requested_by);
 }
 
+/*** parse_frame_size *******************************************************
+ * Parses a WxH frame size in pixels. Aborts execution on error.            *
+ ****************************************************************************/
+void parse_frame_size (char *p){
+	char *numEnd;
+	globalOpts.frame_w = strtol(p, &numEnd, 10);
+	if (*numEnd != 'x' && *numEnd != 'X') error ("Couldn't parse %s as a WxH frame size", p);
+	globalOpts.frame_h = parse_as_number(&numEnd[1], 10);
+	if (globalOpts.frame_w <= 0 || globalOpts.frame_h <= 0) error ("Couldn't parse %s as a WxH frame size", p);
+}
+
 /*** transp_color_from_str **************************************************
  * Tries to get a valid sprite transparency color from a string.            *
  ****************************************************************************/
@@ -72,6 +103,25 @@ long transp_color_from_str(char *color_str){
 	return 1 + parse_as_number(color_str, 10);
 }
 
+/*** parse_rect *************************************************************
+ * Parses a X,Y,W,H region and stores it in the global options.             *
+ ****************************************************************************/
+void parse_rect (char *p){
+	int n, v[4];
+	char *numEnd = p;
+
+	for (n=0; n<4; n++){
+		v[n] = strtol(numEnd, &numEnd, 10);
+		if (*numEnd != (n < 3 ? ',' : '\0')) error ("Couldn't parse %s as a X,Y,W,H region", p);
+		numEnd++;
+	}
+	if (v[0] < 0 || v[1] < 0 || v[2] <= 0 || v[3] <= 0) error ("Couldn't parse %s as a X,Y,W,H region", p);
+	globalOpts.rect_x = v[0];
+	globalOpts.rect_y = v[1];
+	globalOpts.rect_w = v[2];
+	globalOpts.rect_h = v[3];
+}
+
 /*** target_to_string *******************************************************
  * Fills a string buffer with the currently selected target type.           *
  ****************************************************************************/
@@ -118,7 +168,9 @@ void print_help(){
 	printf ("\nConverts PNG images to GB (GBDK) C Code\n");
 	printf ("\n:::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::\n\n", PNGB_VERSION_MAJOR, PNGB_VERSION_MINOR);
 	printf ("Usage\n");
-	printf ("   pngb <options> {input file} {output file}\n\n");
+	printf ("   pngb <options> {input file} {output file} [{input file} {output file} ...]\n");
+	printf ("   An input file.tar converts every PNG in it into the output directory,\n");
+	printf ("   named after their paths in the archive.\n\n");
 	printf ("Options\n");
 	printf ("  -K          Generate code and data for the BKG layer.\n");
 	printf ("  -W          Generate code and data for the WIN layer.\n");
@@ -131,39 +183,234 @@ void print_help(){
 	printf ("  -s          Sort the palette from light to dark (helps with GB compatibility).\n");
 	printf ("  -e          Tile reduction; Remove identical/redundant tiles from the set.\n");
 	printf ("  -v          Verbose output during conversion.\n");
+	printf ("  -M          Metasprite output; drop fully transparent sprite tiles and\n");
+	printf ("              output a dx, dy, tile, attr table with show/move routines.\n");
+	printf ("  -H          Split the output: the data and code go to name.c and the\n");
+	printf ("              defines and extern declarations to name.h.\n");
+	printf ("  -L          Large map mode; output code that streams maps bigger than\n");
+	printf ("              32x32 tiles into the BKG layer as it scrolls.\n");
+	printf ("  -d          Output a VRAM loader that copies a batch of tiles per VBlank\n");
+	printf ("              (using HDMA on GBC).\n");
+	printf ("  -V          GBC: if the BKG/WIN tiles don't fit in VRAM bank 0, split them\n");
+	printf ("              evenly between banks 0 and 1 (attribute bit 3 picks the\n");
+	printf ("              bank of each map cell).\n");
+	printf ("  -z          LZ compress the tile data (-c also outputs the decompressor).\n");
+	printf ("  -Z          LZ compress the tile map and attributes, one row at a time.\n");
 	printf ("  -base NUM   Set the base tile/sprite index.\n");
 	printf ("  -pal  NUM   Set the palette number.\n");
 	printf ("  -name NAME  Set the name of the sprite/tileset.\n");
+	printf ("  -lz LEVEL   Compression level for -z/-Z: 1 = greedy (fast), 2 = optimal.\n");
+	printf ("  -batch NUM  Tiles the VRAM loader copies per VBlank without HDMA, and tiles\n");
+	printf ("              streamed per frame with -slots (def. %d).\n", VBLANK_CPU_TILES);
+	printf ("  -slots NUM  Large maps with more tiles than VRAM holds: keep only the tiles\n");
+	printf ("              around the camera in NUM VRAM slots, and stream the rest in\n");
+	printf ("              as it scrolls, a batch per frame (implies -L and -e).\n");
+	printf ("  -lossy NUM  Lossy tile reduction; also merge tiles that differ in up to\n");
+	printf ("              NUM bits of the 2 bit planes (implies -e).\n");
+	printf ("  -budget NUM Merge the most alike tiles until the set fits in NUM tiles\n");
+	printf ("              (implies -e).\n");
+	printf ("  -base-tiles FILE  Tiles of a .2bpp file are already in VRAM from the\n");
+	printf ("              base index on. Map them there and only output the\n");
+	printf ("              new tiles (implies -e).\n");
+	printf ("  -tiledb FILE Use the tile indexes of a project tile database, adding\n");
+	printf ("              any new tiles at its end (implies -e). The whole\n");
+	printf ("              database is output as the tile set.\n");
+	printf ("  -incremental FILE  Keep the tiles and map of every run in FILE. The\n");
+	printf ("              next run only deduplicates the map cells that changed, and\n");
+	printf ("              the tiles that didn't change keep their indexes (implies -e).\n");
+	printf ("              Only for a single job; in a manifest, each entry needs its own.\n");
+	printf ("  -delta FILE Also write the tiles and map cells that changed since the\n");
+	printf ("              last -incremental run to FILE, to patch VRAM with.\n");
+	printf ("  -bank NUM   Place the data in ROM banks from NUM on, in separate out_bN.c\n");
+	printf ("              files, and output a bank/address/size index table. When\n");
+	printf ("              several images are converted, their data is packed together\n");
+	printf ("              into pngb_banks_bN.c files next to the first output, and\n");
+	printf ("              every output includes the shared index in pngb_banks.h.\n");
+	printf ("              Banks 1 to 31 can be used (the ones MBC1 can switch to).\n");
+	printf ("  -frame WxH  Slice the image into WxH pixel animation frames that share\n");
+	printf ("              one deduplicated tile set and output one map per frame.\n");
+	printf ("  -rect X,Y,W,H  Only convert that region (in pixels) of the picture.\n");
+	printf ("              Jobs on the same picture only decode it once, so an atlas\n");
+	printf ("              can be split with one -rect job (or manifest line) each.\n");
+	printf ("  -check      Only check the given PNG files (and every PNG in the given\n");
+	printf ("              directories) against the options, without converting them.\n");
+	printf ("  -manifest FILE  Also convert every \"input output [options]\" line of\n");
+	printf ("              FILE (# starts a comment). The command line options are\n");
+	printf ("              the defaults of every line. Outputs newer than their\n");
+	printf ("              input and the manifest are left alone.\n");
 	printf ("  -tr COLOR   Set the transparent color for Sprites. COLOR is either \n");
 	printf ("              an index from the source palette, or a color in #RRGGBB format.\n\n");
 	printf ("Examples\n");
 	printf ("   pngb -S spritesheet.png sprite.h\n");
 	printf ("   pngb -S -base 1 -pal 2 -name my_sprite spritesheet.png sprite.h\n");
-	printf ("   pngb -Kgpcmsev -name my_tileset tileset.png tileset.c\n\n");
+	printf ("   pngb -Kgpcmsev -name my_tileset tileset.png tileset.c\n");
+	printf ("   pngb -Sspe -tr 0 hero.png hero.c enemy.png enemy.c\n\n");
 }
 
-/*###########################################################################
- ##                                                                        ##
- ##                                   M A I N                              ##
- ##                                                                        ##
- ###########################################################################*/
-/*** main *******************************************************************
- * There's no place like main().                                            *
+/*** split_file_names *******************************************************
+ * In split output mode (-H) name.c gets the data and code and name.h the   *
+ * declarations, whatever the extension of the given output file was.       *
+ * Both buffers must be 1024 bytes long.                                    *
  ****************************************************************************/
-int main(int argc, char *argv[]){
-	int a, n;
-	char infile[256], outfile[256], temp[64];
-	char *param;
-	FILE *output;
+void split_file_names(char *outfile, char *codefile, char *headerfile){
+	char *ext;
+	snprintf (codefile, 1024 - 2, "%s", outfile);
+	ext = strrchr(codefile, '.');
+	if (!ext || strpbrk(ext, "/\\")) ext = &codefile[strlen(codefile)];
+	strcpy (ext, ".h");
+	strcpy (headerfile, codefile);
+	strcpy (ext, ".c");
+}
 
-	/* TO-DO:
-		- color reduction
-	 */
-	memset((void *)infile, 0, sizeof(infile));
-	memset((void *)outfile, 0, sizeof(outfile));
+/*** has_extension **********************************************************
+ * Tells if a file name ends in 'ext' (in any case).                        *
+ ****************************************************************************/
+int has_extension(const char *name, const char *ext){
+	size_t n = strlen(name), len = strlen(ext);
+	if (n < len) return 0;
+	for (name += n - len; *ext; name++, ext++) if (tolower((unsigned char)*name) != tolower((unsigned char)*ext)) return 0;
+	return 1;
+}
 
-	reset_opts();
-	for (a = 1; a < argc; a++){
+/*** convert_png ************************************************************
+ * Converts a PNG to code. 'png' holds the file if it's already in memory   *
+ * (NULL to read 'infile').                                                 *
+ ****************************************************************************/
+void convert_png(char *infile, const BYTE *png, size_t pngsize, char *outfile){
+	char temp[64], codefile[1024], headerfile[1024], *hname;
+	FILE *header = NULL, *output;
+
+	if (globalOpts.split_header){
+		split_file_names (outfile, codefile, headerfile);
+		outfile = codefile;
+		for (hname = &headerfile[strlen(headerfile)]; hname > headerfile && hname[-1] != '/' && hname[-1] != '\\'; hname--);
+
+		header = fopen(headerfile, "w");
+		if (!header) error ("ERROR: Couldn't create file %s", headerfile);
+	}
+	output = fopen(outfile, "w");
+	if (!output) error ("ERROR: Couldn't create file %s", outfile);
+
+	PICDATA *gbdata = (png ? process_png_data(infile, png, pngsize) : process_image(infile));
+	/* IMPORTANT! CALL THIS BEFORE CODE OUTPUT! This will fix wrong values */
+	gb_check_warnings (gbdata); 
+
+	verbose ("\n<PARAMETERS DEBUG>\nINPUT -\n");
+	verbose (" File            : %s\n", infile);
+	if (globalOpts.type == TARGET_SPRITE){
+		verbose(" Sprite transp.  : %s\n", transp_to_string(temp, sizeof(temp)));
+	}
+
+	verbose ("\nOUTPUT -\n");
+	verbose (" File            : %s\n", outfile);
+	if (header) verbose (" Header file     : %s\n", headerfile);
+	verbose (" Data name       : %s\n", globalOpts.name);
+	verbose (" Grayscale       : %s\n", (globalOpts.grayscale ? "YES" : "NO"));
+	verbose (" Data type       : %s\n", target_to_string(temp, sizeof(temp)));
+	verbose (" Palette         : %s\n", (globalOpts.create_palette ? "YES" : "NO"));
+	verbose (" TileMap         : %s\n", (globalOpts.create_map ? "YES" : "NO"));
+	verbose (" Test Code       : %s\n", (globalOpts.test_code ? "YES" : "NO"));
+	verbose (" Palette Index   : %d\n", globalOpts.palnumber);
+	if (globalOpts.test_code || globalOpts.create_map){
+		verbose (" Tile Base Index : %d\n", globalOpts.baseindex);
+	}	
+
+	verbose ("\nADDITIONAL ACTIONS -\n");
+	if (!globalOpts.grayscale){
+		verbose (" Sort Palette    : %s\n", (globalOpts.sort_palette ? "YES" : "NO"));
+	}
+	verbose (" Tile reduction  : %s\n", (globalOpts.tile_reduction ? "YES" : "NO"));
+	if (globalOpts.lossy_bits) verbose (" Lossy reduction : %d bits\n", globalOpts.lossy_bits);
+	if (globalOpts.tile_budget) verbose (" Tile budget     : %d tiles\n", globalOpts.tile_budget);
+	if (globalOpts.base_tileset[0]) verbose (" Base tiles      : %s\n", globalOpts.base_tileset);
+	if (globalOpts.tiledb[0]) verbose (" Tile database   : %s\n", globalOpts.tiledb);
+	if (globalOpts.incremental[0]) verbose (" Incremental     : %s\n", globalOpts.incremental);
+	if (globalOpts.delta_file[0]) verbose (" Delta output    : %s\n", globalOpts.delta_file);
+	verbose (" Compress tiles  : %s\n", (globalOpts.compress_tiles ? "YES" : "NO"));
+	verbose (" Compress map    : %s\n", (globalOpts.compress_map ? "YES" : "NO"));
+	verbose (" VRAM loader     : %s\n", (globalOpts.vram_loader ? "YES" : "NO"));
+	verbose (" VRAM bank 1     : %s\n", (globalOpts.vram_bank1 ? "YES" : "NO"));
+	verbose (" Large map       : %s\n", (globalOpts.large_map ? "YES" : "NO"));
+	if (globalOpts.stream_slots) verbose (" Tile streaming  : %d VRAM slots\n", globalOpts.stream_slots);
+	verbose (" Metasprite      : %s\n", (globalOpts.metasprite ? "YES" : "NO"));
+	if (globalOpts.rom_bank) verbose (" First ROM bank  : %d\n", globalOpts.rom_bank);
+	if (globalOpts.frame_w) verbose (" Frame size      : %dx%d\n", globalOpts.frame_w, globalOpts.frame_h);
+	if (globalOpts.rect_w) verbose (" Region          : %dx%d at %d,%d\n", globalOpts.rect_w, globalOpts.rect_h, globalOpts.rect_x, globalOpts.rect_y);
+	verbose ("\n");
+
+	code_disclaimer_c (infile, outfile, output);
+	if (header){
+		code_disclaimer_c (infile, headerfile, header);
+		gbdk_c_code_output (gbdata, output, header, hname);
+	}else {
+		gbdk_c_code_output (gbdata, output, NULL, NULL);
+	}
+	if (globalOpts.rom_bank && bank_shared()){
+		bank_share_job (outfile, globalOpts.rom_bank);
+	}else if (globalOpts.rom_bank){
+		gbdk_bank_files_output (infile, outfile);
+		bank_reset ();
+	}
+	free_gb_pict(gbdata);
+
+	verbose ("-- Job memory: %lu bytes peak, %lu bytes reserved\n\n", (unsigned long)jobArena.peak, (unsigned long)jobArena.reserved);
+	/* Everything this job allocated goes away at once. The arena keeps its
+	blocks, so any following job won't need to touch the heap again. */
+	arena_reset(&jobArena);
+
+	fclose (output);
+	if (header) fclose (header);
+}
+
+/*** convert_file ***********************************************************
+ * Converts a PNG file to code.                                             *
+ ****************************************************************************/
+void convert_file(char *infile, char *outfile){
+	convert_png (infile, NULL, 0, outfile);
+}
+
+/*** convert_tar ************************************************************
+ * Converts every PNG of a tar archive in a single pass over it. Each one   *
+ * goes to outdir/<path>.c (with the slashes of its path in the archive     *
+ * replaced by '_'), and its path is also used as the data name.            *
+ ****************************************************************************/
+void convert_tar(char *tarfile, char *outdir, OPTIONS *defaults){
+	TAR_READER tar;
+	char base[512], infile[1024], outfile[1024], *c;
+	int count = 0;
+
+	/* Every PNG of the archive is a job of its own; they share the ROM banks */
+	bank_share ();
+	tar_open (&tar, tarfile);
+	while (tar_next(&tar)){
+		if (!has_extension(tar.name, ".png")) continue;
+		c = tar.name;
+		while (c[0] == '.' && c[1] == '/') c += 2;
+		snprintf (base, sizeof(base), "%s", c);
+		base[strlen(base) - 4] = '\0';
+		for (c = base; *c; c++) if (*c == '/' || *c == '\\') *c = '_';
+
+		snprintf (infile, sizeof(infile), "%s:%s", tarfile, tar.name);
+		snprintf (outfile, sizeof(outfile), "%s/%s.c", outdir, base);
+		globalOpts = *defaults;
+		snprintf (globalOpts.name, sizeof(globalOpts.name), "%s", base);
+		verbose ("\n<%s>\n", infile);
+		convert_png (infile, tar.data, tar.size, outfile);
+		count++;
+	}
+	tar_close (&tar);
+	verbose ("\n-- %d PNG files converted from %s\n", count, tarfile);
+}
+
+/*** parse_args *************************************************************
+ * Applies the options in argv[first..argc-1] to globalOpts, and stores any *
+ * file names found in 'files'. Returns how many file names there were.     *
+ ****************************************************************************/
+int parse_args(int first, int argc, char *argv[], char **files){
+	int a, n, fileCount = 0;
+	char *param;
+
+	for (a = first; a < argc; a++){
 		param = argv[a];
 
 		if (param[0] == '-'){
@@ -182,6 +429,72 @@ int main(int argc, char *argv[]){
 				a++;
 				check_for_enough_args (param, a, argc);
 				strcpy(globalOpts.name, argv[a]);
+			}else if (!strcmp(param, "lz")){
+				a++;
+				check_for_enough_args (param, a, argc);
+				globalOpts.lz_level = parse_as_number(argv[a], 10);
+			}else if (!strcmp(param, "batch")){
+				a++;
+				check_for_enough_args (param, a, argc);
+				globalOpts.vblank_tiles = parse_as_number(argv[a], 10);
+			}else if (!strcmp(param, "slots")){
+				a++;
+				check_for_enough_args (param, a, argc);
+				globalOpts.stream_slots = parse_as_number(argv[a], 10);
+				if (globalOpts.stream_slots < 1) error ("There must be at least 1 VRAM slot");
+				globalOpts.large_map = 1;
+				globalOpts.tile_reduction = 1;
+			}else if (!strcmp(param, "lossy")){
+				a++;
+				check_for_enough_args (param, a, argc);
+				globalOpts.lossy_bits = parse_as_number(argv[a], 10);
+				globalOpts.tile_reduction = 1;
+			}else if (!strcmp(param, "budget")){
+				a++;
+				check_for_enough_args (param, a, argc);
+				globalOpts.tile_budget = parse_as_number(argv[a], 10);
+				if (globalOpts.tile_budget < 1) error ("The tile budget must be at least 1 tile");
+				globalOpts.tile_reduction = 1;
+			}else if (!strcmp(param, "base-tiles")){
+				a++;
+				check_for_enough_args (param, a, argc);
+				snprintf (globalOpts.base_tileset, sizeof(globalOpts.base_tileset), "%s", argv[a]);
+				globalOpts.tile_reduction = 1;
+			}else if (!strcmp(param, "tiledb")){
+				a++;
+				check_for_enough_args (param, a, argc);
+				snprintf (globalOpts.tiledb, sizeof(globalOpts.tiledb), "%s", argv[a]);
+				globalOpts.tile_reduction = 1;
+			}else if (!strcmp(param, "incremental")){
+				a++;
+				check_for_enough_args (param, a, argc);
+				snprintf (globalOpts.incremental, sizeof(globalOpts.incremental), "%s", argv[a]);
+				globalOpts.tile_reduction = 1;
+			}else if (!strcmp(param, "delta")){
+				a++;
+				check_for_enough_args (param, a, argc);
+				snprintf (globalOpts.delta_file, sizeof(globalOpts.delta_file), "%s", argv[a]);
+			}else if (!strcmp(param, "bank")){
+				a++;
+				check_for_enough_args (param, a, argc);
+				globalOpts.rom_bank = parse_as_number(argv[a], 10);
+			}else if (!strcmp(param, "frame")){
+				a++;
+				check_for_enough_args (param, a, argc);
+				parse_frame_size(argv[a]);
+				/* Tiles shared by several frames are only output once */
+				globalOpts.tile_reduction = 1;
+			}else if (!strcmp(param, "rect")){
+				a++;
+				check_for_enough_args (param, a, argc);
+				parse_rect(argv[a]);
+			}else if (!strcmp(param, "check")){
+				checkOnly = 1;
+			}else if (!strcmp(param, "manifest")){
+				a++;
+				check_for_enough_args (param, a, argc);
+				if (manifestFile) error ("Only one manifest can be used");
+				manifestFile = argv[a];
 			}else if (!strcmp(param, "tr")){
 				a++;
 				check_for_enough_args (param, a, argc);
@@ -227,64 +540,276 @@ int main(int argc, char *argv[]){
 						case 'v':
 							globalOpts.verbose = 1;
 							break;
+						case 'z':
+							globalOpts.compress_tiles = 1;
+							break;
+						case 'Z':
+							globalOpts.compress_map = 1;
+							break;
+						case 'd':
+							globalOpts.vram_loader = 1;
+							break;
+						case 'L':
+							globalOpts.large_map = 1;
+							break;
+						case 'M':
+							/* Metasprites are always deduplicated */
+							globalOpts.metasprite = 1;
+							globalOpts.tile_reduction = 1;
+							break;
+						case 'H':
+							globalOpts.split_header = 1;
+							break;
+						case 'V':
+							globalOpts.vram_bank1 = 1;
+							break;
 						default:
 							error ("Unrecognized option %c", param[n]);
 					}
 				}
 			}
 		}else {
-			if (infile[0] == 0) {
-				/* assume this is the input file */
-				strncpy (infile, argv[a], sizeof(infile)-1);
-			} else if (outfile[0] == 0){
-				/* if the input file is already defined, this must be the
-				output file */
-				strncpy (outfile, argv[a], sizeof(infile)-1);
+			/* Files come in input/output pairs; one pair per job */
+			files[fileCount++] = argv[a];
+		}
+	}
+	return fileCount;
+}
+
+/*** check_option_conflicts *************************************************
+ * Aborts if the options given can't be used together.                      *
+ ****************************************************************************/
+void check_option_conflicts(){
+	if (globalOpts.base_tileset[0] && globalOpts.tiledb[0]) error ("-base-tiles and -tiledb can't be used together");
+	if (globalOpts.delta_file[0] && !globalOpts.incremental[0]) error ("-delta needs an incremental build file (-incremental)");
+	if (globalOpts.incremental[0]){
+		/* These would renumber the tiles the sidecar keeps in place */
+		if (globalOpts.base_tileset[0] || globalOpts.tiledb[0]) error ("-incremental can't be used with -base-tiles or -tiledb");
+		if (globalOpts.lossy_bits || globalOpts.tile_budget) error ("-incremental can't be used with -lossy or -budget");
+		if (globalOpts.metasprite) error ("-incremental can't be used with metasprites (-M)");
+	}
+}
+
+/*###########################################################################
+ ##                                                                        ##
+ ##                          M A N I F E S T S                             ##
+ ##                                                                        ##
+ ###########################################################################*/
+/*** file_mtime *************************************************************
+ * Returns the last modification time of a file, or 0 if it doesn't exist.  *
+ ****************************************************************************/
+time_t file_mtime(const char *filename){
+	struct stat st;
+	if (stat(filename, &st)) return 0;
+	return st.st_mtime;
+}
+
+/*** split_manifest_line ****************************************************
+ * Splits a manifest line in place into whitespace separated words. Words   *
+ * can be "quoted" to hold spaces. A # outside quotes ends the line.        *
+ * Returns the number of words stored in 'words' (at most 'max').           *
+ ****************************************************************************/
+int split_manifest_line(char *line, char **words, int max){
+	int count = 0;
+	char *src = line, *dst;
+
+	while (1){
+		while (*src && isspace((unsigned char)*src)) src++;
+		if (!*src || *src == '#') break;
+		if (count == max) error ("Too many words in a manifest line");
+		words[count++] = dst = src;
+		/* Copy the word down over the quotes it has */
+		while (*src && (*src == '"' || !isspace((unsigned char)*src))){
+			if (*src == '"'){
+				for (src++; *src && *src != '"'; ) *dst++ = *src++;
+				if (*src) src++;
 			}else {
-				error ("Too many parameters");
+				*dst++ = *src++;
 			}
 		}
+		if (*src) src++;
+		*dst = '\0';
 	}
-	if (!infile[0] || !outfile[0]) {
-		print_help();
-		return 0;
+	return count;
+}
+
+/*** entry_is_stale *********************************************************
+ * Tells if an entry needs to be converted: its output is missing or older  *
+ * than the input, the manifest, the base tiles, the tile database or the   *
+ * incremental sidecar it was built from.                                   *
+ ****************************************************************************/
+int entry_is_stale(MANIFEST_ENTRY *e){
+	char codefile[1024], headerfile[1024];
+	time_t built;
+
+	if (e->opts.split_header){
+		split_file_names (e->output, codefile, headerfile);
+		built = file_mtime(codefile);
+		if (file_mtime(headerfile) < built) built = file_mtime(headerfile);
+	}else {
+		built = file_mtime(e->output);
 	}
+	if (!built) return 1;
+	if (file_mtime(e->input) > built || file_mtime(manifestFile) > built) return 1;
+	if (e->opts.base_tileset[0] && file_mtime(e->opts.base_tileset) > built) return 1;
+	if (e->opts.tiledb[0] && file_mtime(e->opts.tiledb) > built) return 1;
+	if (e->opts.incremental[0] && file_mtime(e->opts.incremental) > built) return 1;
+	return 0;
+}
 
-	output = fopen(outfile, "w");
-	PICDATA *gbdata = process_image (infile);
-	/* IMPORTANT! CALL THIS BEFORE CODE OUTPUT! This will fix wrong values */
-	gb_check_warnings (gbdata); 
+/*** load_manifest **********************************************************
+ * Reads every "input output [options]" line of the manifest. The options   *
+ * of each entry start from 'defaults' (the command line options).          *
+ ****************************************************************************/
+MANIFEST_ENTRY *load_manifest(const char *filename, OPTIONS *defaults, int *count){
+	MANIFEST_ENTRY *entries = NULL, *e;
+	char buffer[4096], *words[256], *line;
+	int lineno = 0, nwords, n;
+	FILE *f = fopen(filename, "r");
 
-	verbose ("\n<PARAMETERS DEBUG>\nINPUT -\n");
-	verbose (" File            : %s\n", infile);
-	if (globalOpts.type == TARGET_SPRITE){
-		verbose(" Sprite transp.  : %s\n", transp_to_string(temp, sizeof(temp)));
+	if (!f) error ("ERROR: Couldn't open manifest %s", filename);
+	*count = 0;
+	while (fgets(buffer, sizeof(buffer), f)){
+		lineno++;
+		line = strdup(buffer);
+		if (!line) error ("ERROR: Out of memory.");
+		nwords = split_manifest_line(line, words, 256);
+		if (!nwords){
+			free (line);
+			continue;
+		}
+
+		entries = (MANIFEST_ENTRY *)realloc(entries, (*count + 1)*sizeof(MANIFEST_ENTRY));
+		if (!entries) error ("ERROR: Out of memory.");
+		e = &entries[(*count)++];
+		e->line		= line;
+		e->lineno	= lineno;
+
+		/* parse_args() works on globalOpts; the entry keeps its own copy.
+		The file names are moved to the front of 'words'. */
+		globalOpts = *defaults;
+		if (parse_args(0, nwords, words, words) != 2) error ("%s:%d: Every manifest entry needs one input and one output file", filename, lineno);
+		check_option_conflicts ();
+		e->input	= words[0];
+		e->output	= words[1];
+		e->opts		= globalOpts;
+		for (n = 0; e->opts.incremental[0] && n < *count - 1; n++){
+			if (!strcmp(entries[n].opts.incremental, e->opts.incremental)) error ("%s:%d: %s is already the -incremental file of line %d", filename, lineno, e->opts.incremental, entries[n].lineno);
+		}
 	}
+	fclose (f);
+	globalOpts = *defaults;
+	return entries;
+}
 
-	verbose ("\nOUTPUT -\n");
-	verbose (" File            : %s\n", outfile);
-	verbose (" Data name       : %s\n", globalOpts.name);
-	verbose (" Grayscale       : %s\n", (globalOpts.grayscale ? "YES" : "NO"));
-	verbose (" Data type       : %s\n", target_to_string(temp, sizeof(temp)));
-	verbose (" Palette         : %s\n", (globalOpts.create_palette ? "YES" : "NO"));
-	verbose (" TileMap         : %s\n", (globalOpts.create_map ? "YES" : "NO"));
-	verbose (" Test Code       : %s\n", (globalOpts.test_code ? "YES" : "NO"));
-	verbose (" Palette Index   : %d\n", globalOpts.palnumber);
-	if (globalOpts.test_code || globalOpts.create_map){
-		verbose (" Tile Base Index : %d\n", globalOpts.baseindex);
-	}	
+/*** run_manifest ***********************************************************
+ * Converts the entries of the manifest that are out of date. Entries that  *
+ * share a tile database (-tiledb) output the whole database as their tile  *
+ * set, so they depend on each other: if one of them is rebuilt all of them *
+ * are, and all of their tiles go into the database before any of them is   *
+ * output. The same goes for entries placed in ROM banks (-bank), as the    *
+ * shared bank files are written again as a whole.                          *
+ ****************************************************************************/
+void run_manifest(OPTIONS *defaults){
+	int count, n, m, changed, built = 0;
+	MANIFEST_ENTRY *entries = load_manifest(manifestFile, defaults, &count);
 
-	verbose ("\nADDITIONAL ACTIONS -\n");
-	if (!globalOpts.grayscale){
-		verbose (" Sort Palette    : %s\n", (globalOpts.sort_palette ? "YES" : "NO"));
+	bank_share ();
+	for (n = 0; n < count; n++){
+		entries[n].stale = entry_is_stale(&entries[n]);
+		/* Jobs given on the command line may have put data in the banks already */
+		if (entries[n].opts.rom_bank && bank_shared_jobs()) entries[n].stale = 1;
 	}
-	verbose (" Tile reduction  : %s\n", (globalOpts.tile_reduction ? "YES" : "NO"));
-	verbose ("\n");
+	do {
+		changed = 0;
+		for (n = 0; n < count; n++){
+			if (!entries[n].stale) continue;
+			for (m = 0; m < count; m++){
+				if (entries[m].stale) continue;
+				if ((entries[n].opts.tiledb[0] && !strcmp(entries[m].opts.tiledb, entries[n].opts.tiledb)) || (entries[n].opts.rom_bank && entries[m].opts.rom_bank)){
+					entries[m].stale = changed = 1;
+				}
+			}
+		}
+	}while (changed);
 
-	code_disclaimer_c (infile, outfile, output);
-	gbdk_c_code_output (gbdata, output);
-	free_gb_pict(gbdata);
+	/* First pass: fill the shared tile databases */
+	for (n = 0; n < count; n++){
+		if (!entries[n].stale || !entries[n].opts.tiledb[0]) continue;
+		globalOpts = entries[n].opts;
+		verbose ("\n<MANIFEST LINE %d: ADDING %s TO %s>\n", entries[n].lineno, entries[n].input, entries[n].opts.tiledb);
+		free_gb_pict (process_image(entries[n].input));
+		arena_reset (&jobArena);
+	}
 
-	if (output) fclose (output);
+	/* Second pass: the actual conversions */
+	for (n = 0; n < count; n++){
+		if (!entries[n].stale) continue;
+		globalOpts = entries[n].opts;
+		verbose ("\n<MANIFEST LINE %d: %s>\n", entries[n].lineno, entries[n].input);
+		convert_file (entries[n].input, entries[n].output);
+		built++;
+	}
+
+	globalOpts = *defaults;
+	verbose ("\n-- Manifest: %d entries, %d converted, %d up to date\n", count, built, count - built);
+	for (n = 0; n < count; n++) free (entries[n].line);
+	free (entries);
+}
+
+/*###########################################################################
+ ##                                                                        ##
+ ##                                   M A I N                              ##
+ ##                                                                        ##
+ ###########################################################################*/
+/*** main *******************************************************************
+ * There's no place like main().                                            *
+ ****************************************************************************/
+int main(int argc, char *argv[]){
+	int n, fileCount = 0;
+	char **files = (char **)malloc(argc*sizeof(char *));
+	OPTIONS batchOpts;
+
+	/* TO-DO:
+		- color reduction
+	 */
+	reset_opts();
+	fileCount = parse_args(1, argc, argv, files);
+	if (!fileCount && !manifestFile) {
+		print_help();
+		free (files);
+		return 0;
+	}
+	if (checkOnly){
+		n = preflight_check(files, fileCount);
+		arena_release(&jobArena);
+		free (files);
+		return (n ? 1 : 0);
+	}
+	if (fileCount & 1) error ("No output file for %s", files[fileCount-1]);
+	check_option_conflicts ();
+	/* A sidecar holds the tiles and map of a single picture */
+	if (globalOpts.incremental[0] && (fileCount > 2 || manifestFile || has_extension(files[0], ".tar"))) error ("-incremental only works with a single job; give each manifest entry its own sidecar instead");
+
+	/* Conversions adjust the options to the image (see gb_check_warnings),
+	so every job starts again from what was given in the command line. */
+	batchOpts = globalOpts;
+	/* The jobs of a batch are packed into ROM banks together */
+	if (fileCount > 2) bank_share ();
+	for (n = 0; n < fileCount; n += 2){
+		globalOpts = batchOpts;
+		if (fileCount > 2) verbose ("\n<JOB %d OF %d>\n", n/2 + 1, fileCount/2);
+		if (has_extension(files[n], ".tar")) convert_tar (files[n], files[n+1], &batchOpts);
+		else convert_file (files[n], files[n+1]);
+	}
+	if (manifestFile) run_manifest (&batchOpts);
+	gbdk_shared_banks_output ();
+
+	bank_reset ();
+	tiledb_release ();
+	decode_workspace_release ();
+	arena_release(&jobArena);
+	free (files);
 	return 0;
 }
+
@@ -28,12 +28,52 @@
 ** 	
 *****************************************************************************/
 #include <time.h>
+#include <sys/stat.h>
 #include "lodepng.h"
 #include "pngb.h"
 
-#define MIN(a, b) (a < b ? a : b)
-
 OPTIONS globalOpts;
+/* Header that gets the declarations in split output mode (see gbdk_decl_file) */
+FILE *declFile = NULL;
+
+/* A PNG on its way through the conversion stages (see process_image). */
+typedef struct{
+	const char *filename;
+	BYTE *png;					/* The PNG file as read from disk (in the decode workspace).            */
+	size_t pngsize;
+	BYTE *image;				/* Decoded pixels, as packed palette indexes (in the workspace too).    */
+	unsigned int width;
+	unsigned int height;
+	LodePNGState state;
+	PICDATA *result;			/* The picture being packed (allocated when the first strip arrives).   */
+	RGB_PALETTE_ENTRY *palette;	/* Palette of the picture.                                              */
+	BYTE *palette_map;			/* Maps the colors of the PNG to the 4 of the picture.                  */
+	int frames_across;			/* Animation frames per row of the sheet (0 if it's not a sheet).       */
+	BYTE lut_lo[256];			/* Pixel byte to GB plane tables (see build_pack_tables).               */
+	BYTE lut_hi[256];
+}PNG_JOB;
+
+/* Buffers every PNG is read and decoded into. They are kept from one job to
+the next and only ever grow, so a batch of pictures of similar size doesn't
+allocate them again. */
+typedef struct{
+	BYTE *file;					/* The PNG file.                                                        */
+	size_t filesize;			/* Bytes allocated for the file.                                        */
+	LodePNGDecodeBuffers buffers;
+	/* What's needed to reuse the decoded image for another job on the same file */
+	char source[1024];			/* File the image was decoded from ("" if it can't be reused).          */
+	time_t mtime;				/* Modification time of that file when it was decoded.                  */
+	long size;					/* Size of that file when it was decoded.                               */
+	unsigned int width;
+	unsigned int height;
+	LodePNGColorType colortype;
+	unsigned int bitdepth;
+	BYTE palette[1024];			/* RGBA palette of the image.                                           */
+	size_t palettesize;
+}DECODE_WORKSPACE;
+
+static DECODE_WORKSPACE workspace;
+
 /*###########################################################################
  ##                                                                        ##
  ##                     M I S C   F U N C T I O N S                        ##
@@ -84,6 +124,14 @@ int is8x16Mode(){
 	return (globalOpts.big_sprite && globalOpts.type == TARGET_SPRITE);
 }
 
+/*** first_data_tile ********************************************************
+ * Returns the VRAM index where the first tile of name_dat[] goes. It's the *
+ * base index, unless the tile set starts with -base-tiles tiles.           *
+ ****************************************************************************/
+int first_data_tile(PICDATA *gbpic){
+	return globalOpts.baseindex + gbpic->base_tiles*(is8x16Mode() ? 2 : 1);
+}
+
 /*###########################################################################
  ##                                                                        ##
  ##          P A L E T T E   A N D   C O L O R   H A N D L I N G           ##
@@ -124,7 +172,7 @@ int find_palette_color(BYTE r, BYTE g, BYTE b, RGB_PALETTE_ENTRY *palette, BYTE
  * Create a "GB-compatible" 4-shade grayscale palette.                      *
  ****************************************************************************/
 RGB_PALETTE_ENTRY *create_gb_gray_pal(){
-	RGB_PALETTE_ENTRY *pal = (RGB_PALETTE_ENTRY *)malloc(4*sizeof(RGB_PALETTE_ENTRY));
+	RGB_PALETTE_ENTRY *pal = (RGB_PALETTE_ENTRY *)arena_alloc(&jobArena, 4*sizeof(RGB_PALETTE_ENTRY));
 
 	set_palette_color (&pal[0], WHITE_VAL		, WHITE_VAL		, WHITE_VAL);
 	set_palette_color (&pal[1], LIGHTGRAY_VAL	, LIGHTGRAY_VAL	, LIGHTGRAY_VAL);
@@ -233,7 +281,7 @@ void sort_palette(RGB_PALETTE_ENTRY *palette, BYTE *palette_map, BYTE tColors, B
 PICDATA *allocate_gb_pict(int w, int h, int _16hMode){
 	int t;
 
-	PICDATA *picd = (PICDATA *)malloc(sizeof(PICDATA));
+	PICDATA *picd = (PICDATA *)arena_alloc(&jobArena, sizeof(PICDATA));
 	picd->tileh	= (_16hMode? 16 : 8);
 	picd->w = w;
 	picd->h = h;
@@ -244,11 +292,17 @@ PICDATA *allocate_gb_pict(int w, int h, int _16hMode){
 	picd->total_tiles = picd->cols*picd->rows;
 	/* Each byte contains 4 pixels of data so it's 2 bytes per row */
 	int tBytes = picd->total_tiles*picd->tileh*2;
-	picd->tiles = (unsigned char *)malloc(tBytes);
+	picd->tiles = (unsigned char *)arena_alloc(&jobArena, tBytes);
 	memset (picd->tiles, 0, tBytes);
 
 	/* Tilemap will always be cols x rows */
-	picd->tilemap = (unsigned int *)malloc(picd->total_tiles*sizeof(unsigned int));
+	picd->tilemap = (unsigned int *)arena_alloc(&jobArena, picd->total_tiles*sizeof(unsigned int));
+
+	picd->frames = 1;
+	picd->base_tiles = 0;
+	picd->bank1_tiles = 0;
+	picd->tile_slot = NULL;
+	picd->stream_slots = 0;
 
 	/* Generate a default non-optimized tilemap for this picture */
 	for (t=0; t<picd->total_tiles; t++) picd->tilemap[t] = t;
@@ -256,14 +310,95 @@ PICDATA *allocate_gb_pict(int w, int h, int _16hMode){
 	return picd;
 }
 
+/*** slice_gb_frames ********************************************************
+ * Turns the picture into an animation sheet of frame_w x frame_h frames.   *
+ * Frames are stored one after the other in reading order, so frame 'f'     *
+ * uses cells f*cols*rows/frames onwards. Returns how many frames there are *
+ * on each row of the sheet.                                                *
+ ****************************************************************************/
+int slice_gb_frames(PICDATA *pic, int frame_w, int frame_h){
+	if (frame_w % 8 || frame_h % pic->tileh) error ("ERROR: The frame size must be a multiple of 8x%d pixels.", pic->tileh);
+	if (pic->w % frame_w || pic->h % frame_h) error ("ERROR: The picture (%dx%d) can't be evenly divided in %dx%d frames.", pic->w, pic->h, frame_w, frame_h);
+
+	int across = pic->w / frame_w;
+	pic->frames	= across * (pic->h / frame_h);
+	pic->w		= frame_w;
+	pic->h		= frame_h;
+	pic->cols	= frame_w / 8;
+	pic->rows	= pic->frames * (frame_h / pic->tileh);
+	return across;
+}
+
+/*** sheet_tile_index *******************************************************
+ * Returns the tile that holds tile column 'tx' and row 'ty' of the source  *
+ * image. Images sliced with slice_gb_frames() ('across' frames per row of  *
+ * the sheet) store each frame contiguously; otherwise it's just row-major. *
+ ****************************************************************************/
+int sheet_tile_index(PICDATA *pic, int tx, int ty, int across){
+	if (!across) return ty*pic->cols + tx;
+
+	int frame_rows = pic->rows / pic->frames;
+	int t = ((ty/frame_rows)*across + tx/pic->cols)*pic->cols*frame_rows;
+	return t + (ty%frame_rows)*pic->cols + tx%pic->cols;
+}
+
+/*** build_pack_tables ******************************************************
+ * Builds the tables pack_tile_rows() uses: they map every possible byte of *
+ * 'bitdepth' bpp pixels (through 'palette_map') to its bits in the two GB  *
+ * planes. 'mapsize' is the number of entries in 'palette_map'.             *
+ ****************************************************************************/
+void build_pack_tables(BYTE *lut_lo, BYTE *lut_hi, int bitdepth, BYTE *palette_map, int mapsize){
+	int v, p, idx, color, ppb = 8/bitdepth;
+
+	for (v=0; v<256; v++){
+		lut_lo[v] = lut_hi[v] = 0;
+		for (p=0; p<ppb; p++){
+			/* Out of range pixels are left as color 0, like set_tile_pixel() does */
+			idx = (v << (p*bitdepth) & 0xff) >> (8-bitdepth);
+			color = (idx < mapsize && palette_map[idx] < 4 ? palette_map[idx] : 0);
+			lut_lo[v] = (lut_lo[v] << 1) | (color & 1);
+			lut_hi[v] = (lut_hi[v] << 1) | ((color >> 1) & 1);
+		}
+	}
+}
+
+/*** pack_tile_rows *********************************************************
+ * Fast path for images that are a multiple of 8 pixels wide. Packs 'rows'  *
+ * rows of the image from 'first' on with the tables of build_pack_tables(),*
+ * so each 8 pixel tile row takes 'bitdepth' lookups, whatever the palette  *
+ * is.                                                                      *
+ ****************************************************************************/
+void pack_tile_rows(PICDATA *pic, const BYTE *image, int width, int first, int rows, int bitdepth, const BYTE *lut_lo, const BYTE *lut_hi, int across){
+	const BYTE *src;
+	BYTE *dst;
+	int ppb = 8/bitdepth, rowbytes = width*bitdepth/8;
+	int x, y, tx;
+	unsigned int lo, hi;
+
+	for (y=first; y<first+rows; y++){
+		src = &image[y*rowbytes];
+		for (tx=0; tx<width/8; tx++){
+			lo = hi = 0;
+			for (x=0; x<bitdepth; x++, src++){
+				lo = (lo << ppb) | lut_lo[*src];
+				hi = (hi << ppb) | lut_hi[*src];
+			}
+			dst = &pic->tiles[(sheet_tile_index(pic, tx, y/pic->tileh, across)*pic->tileh + y%pic->tileh)*2];
+			dst[0] = (BYTE)lo;
+			dst[1] = (BYTE)hi;
+		}
+	}
+}
+
 /*** free_gb_pict ***********************************************************
  * The opposite from the function above, I guess.                           *
  ****************************************************************************/
 void free_gb_pict(PICDATA *data){
 	if (!data) return;
-	free (data->tiles);
-	free (data->tilemap);
-	free (data);
+	arena_free (data->tile_slot);
+	arena_free (data->tilemap);
+	arena_free (data->tiles);
+	arena_free (data);
 }
 
 /*** set_tile_pixel *********************************************************
@@ -287,7 +422,7 @@ void set_tile_pixel(PICDATA *data, unsigned int tile, unsigned char x, unsigned
  * row data is stored in an "interleaved" fashion in the gameboy hardware.  *
  ****************************************************************************/
 unsigned short get_tile_row(PICDATA *data, unsigned int tile, unsigned int row){
-	if (!data || row >= data->tileh || tile >= data->cols*data->rows) return 0;
+	if (!data || row >= data->tileh || tile >= (unsigned int)data->total_tiles) return 0;
 	int base =tile*data->tileh*2 + row*2;
 	return (unsigned short)((unsigned char)data->tiles[base]<<8 | (unsigned char)data->tiles[base+1]&0xff);
 }
@@ -310,7 +445,7 @@ void set_gb_pal_entry(PICDATA *data, unsigned int index, BYTE r, BYTE g, BYTE b)
  * Compares two GB tiles. Returns zero if equal.                            *
  ****************************************************************************/
 int compare_gb_tiles(PICDATA *pic, unsigned int t0, unsigned int t1){
-	if (!pic || t0 >= pic->cols*pic->rows || t1 >= pic->cols*pic->rows) return 1;
+	if (!pic || t0 >= (unsigned int)pic->total_tiles || t1 >= (unsigned int)pic->total_tiles) return 1;
 	if (t0 == t1) return 1;
 
 	int tdatasize = pic->tileh*2;
@@ -321,20 +456,53 @@ int compare_gb_tiles(PICDATA *pic, unsigned int t0, unsigned int t1){
  * Copies a tile inside PICDATA, from 'src' to 'dest'.                      *
  ****************************************************************************/
 void copy_gb_tile(PICDATA *pic, unsigned int dest, unsigned int src){
-	if (!pic || dest >= pic->cols*pic->rows || src >= pic->cols*pic->rows) return;
+	if (!pic || dest >= (unsigned int)pic->total_tiles || src >= (unsigned int)pic->total_tiles) return;
 	int tdatasize = pic->tileh*2;
 	memcpy (&pic->tiles[dest*tdatasize], &pic->tiles[src*tdatasize], tdatasize);
 }
 
-/*** replace_in_tilemap *****************************************************
- * Replaces any reference in PICDATA to tile 'told' with 'tnew'.            *
+/*** hash_gb_tile ***********************************************************
+ * Returns a hash (FNV-1a) of the contents of a tile.                       *
  ****************************************************************************/
-void replace_in_tilemap(PICDATA *pic, unsigned int told, unsigned int tnew){
-	if (!pic) return;
-	int t, mapsize = pic->cols*pic->rows;
-	for (t=0; t<mapsize; t++) {
-		if (pic->tilemap[t] == told) pic->tilemap[t] = tnew;
-	}
+unsigned int hash_gb_tile(PICDATA *pic, unsigned int t){
+	int i, tdatasize = pic->tileh*2;
+	BYTE *data = &pic->tiles[t*tdatasize];
+	unsigned int h = 2166136261U;
+	for (i=0; i<tdatasize; i++) h = (h ^ data[i]) * 16777619U;
+	return h;
+}
+
+/*** load_base_tiles ********************************************************
+ * Puts the tiles of a raw .2bpp file in front of the tiles of the picture, *
+ * so tile reduction maps every tile already in that set to its index in    *
+ * it. Those tiles are never output (see PICDATA.base_tiles).               *
+ ****************************************************************************/
+void load_base_tiles(PICDATA *pic, const char *filename){
+	int c, tdatasize = pic->tileh*2, mapsize = pic->cols*pic->rows;
+	unsigned char *data;
+	size_t size;
+	BYTE *tiles;
+
+	unsigned int err = lodepng_load_file(&data, &size, filename);
+	if (err) error("ERROR %u: %s (%s)\n", err, lodepng_error_text(err), filename);
+	if (!size || size % tdatasize) error ("ERROR: %s is not a set of %d byte tiles.", filename, tdatasize);
+
+	pic->base_tiles = size / tdatasize;
+	tiles = (BYTE *)arena_alloc(&jobArena, size + pic->total_tiles*tdatasize);
+	memcpy (tiles, data, size);
+	memcpy (&tiles[size], pic->tiles, pic->total_tiles*tdatasize);
+	pic->tiles = tiles;
+	pic->total_tiles += pic->base_tiles;
+	for (c=0; c<mapsize; c++) pic->tilemap[c] += pic->base_tiles;
+	verbose ("-- %d tiles loaded from %s\n", pic->base_tiles, filename);
+}
+
+/*** compare_positions ******************************************************
+ * qsort() callback that sorts tile positions in ascending order.           *
+ ****************************************************************************/
+int compare_positions(const void *a, const void *b){
+	unsigned int pa = *(const unsigned int *)a, pb = *(const unsigned int *)b;
+	return (pa > pb) - (pa < pb);
 }
 
 /*** do_tile_reduction *****************************************************
@@ -343,69 +511,441 @@ void replace_in_tilemap(PICDATA *pic, unsigned int told, unsigned int tnew){
 void do_tile_reduction(PICDATA *pic){
 	if (!pic) return;
 
-	int t2, t1 = 0;
-	int old_tTiles = pic->total_tiles;
-
-	for (t1=0; t1<pic->total_tiles; t1++){
-		t2 = t1+1;
-		while (t2 < pic->total_tiles){
-			if (compare_gb_tiles(pic, t1, t2) == 0){
-				/* t1 and t2 are the same. Let's remove t2 and replace all references to t2 for t1. */
-				replace_in_tilemap (pic, t2, t1);
-				/* Now to "delete" it we will copy the current last tile into t2 and then lower the "total_tiles" count. */
-				copy_gb_tile(pic, t2, pic->total_tiles-1);
-				/* All the references to the "last tile" we just swapped positions with,
-				should be replaced with t2, which is the new position it occupies. */
-				replace_in_tilemap (pic, pic->total_tiles-1, t2);
-				pic->total_tiles--;
-			}else{
-				t2++;
+	unsigned int t, o, g, h, mask, last, slots = 1;
+	int c, lo, hi, count, total = pic->total_tiles, old_tTiles = pic->total_tiles;
+	int tdatasize = pic->tileh*2, mapsize = pic->cols*pic->rows;
+
+	/*	Identical tiles are grouped through a hash index (open addressing, at
+		most half full), so no tile is compared with more than a few others. */
+	while (slots < 2*(unsigned int)old_tTiles) slots <<= 1;
+	mask = slots - 1;
+	unsigned int *first = (unsigned int *)arena_alloc(&jobArena, old_tTiles*sizeof(unsigned int));
+	unsigned int *next = (unsigned int *)arena_alloc(&jobArena, old_tTiles*sizeof(unsigned int));
+	unsigned int *at = (unsigned int *)arena_alloc(&jobArena, old_tTiles*sizeof(unsigned int));
+	unsigned int *pos = (unsigned int *)arena_alloc(&jobArena, old_tTiles*sizeof(unsigned int));
+	unsigned int *keep = (unsigned int *)arena_alloc(&jobArena, old_tTiles*sizeof(unsigned int));
+	unsigned int *dups = (unsigned int *)arena_alloc(&jobArena, old_tTiles*sizeof(unsigned int));
+	unsigned int *index = (unsigned int *)arena_alloc(&jobArena, slots*sizeof(unsigned int));
+	for (h=0; h<slots; h++) index[h] = TILE_EMPTY;
+
+	/* 'first' is the first tile of the group, and 'next' links the group in order */
+	for (t=0; t<(unsigned int)old_tTiles; t++){
+		h = hash_gb_tile(pic, t) & mask;
+		while (index[h] != TILE_EMPTY && compare_gb_tiles(pic, index[h], t) != 0) h = (h+1) & mask;
+		if (index[h] == TILE_EMPTY){
+			index[h] = t;
+			first[t] = t;
+		}else {
+			/* 'dups' holds the last tile of every group for now */
+			next[dups[index[h]]] = t;
+			first[t] = index[h];
+		}
+		dups[first[t]] = t;
+		next[t] = keep[t] = TILE_EMPTY;
+		at[t] = pos[t] = t;
+	}
+
+	/*	The tiles end up in the same order as removing each duplicate by moving
+		the last tile into its place, which is how the tile sets were always
+		numbered. The moves are done on tile numbers; the data is moved once.
+		Whichever tile of a group comes first by then is the one kept. */
+	for (t=0; t<(unsigned int)total; t++){
+		o = at[t];
+		g = first[o];
+		if (keep[g] != TILE_EMPTY) continue;
+		keep[g] = o;
+		/* Tiles already in VRAM keep their index, even if repeated */
+		for (count=0, c=g; c != (int)TILE_EMPTY; c=next[c]){
+			if ((unsigned int)c != o && pos[c] >= (unsigned int)pic->base_tiles) dups[count++] = pos[c];
+		}
+		qsort (dups, count, sizeof(unsigned int), compare_positions);
+		for (lo=0, hi=count-1; lo<=hi; ){
+			h = dups[lo++];
+			while (1){
+				last = --total;
+				if (last == h) break;
+				/* A duplicate moved into the gap is removed right away too */
+				if (hi >= lo && dups[hi] == last){
+					hi--;
+					continue;
+				}
+				at[h] = at[last];
+				pos[at[h]] = h;
+				break;
 			}
 		}
 	}
+
+	BYTE *tiles = (BYTE *)arena_alloc(&jobArena, total*tdatasize);
+	for (t=0; t<(unsigned int)total; t++) memcpy (&tiles[t*tdatasize], &pic->tiles[at[t]*tdatasize], tdatasize);
+	memcpy (pic->tiles, tiles, total*tdatasize);
+	for (c=0; c<mapsize; c++){
+		o = pic->tilemap[c];
+		pic->tilemap[c] = (o < (unsigned int)pic->base_tiles ? o : pos[keep[first[o]]]);
+	}
+
+	pic->total_tiles = total;
+	arena_free (tiles);
+	arena_free (index);
+	arena_free (dups);
+	arena_free (keep);
+	arena_free (pos);
+	arena_free (at);
+	arena_free (next);
+	arena_free (first);
 	verbose ("-- %d tiles reduced. New tile count: %d\n", old_tTiles - pic->total_tiles, pic->total_tiles);
 }
+
+/*** tile_distance **********************************************************
+ * Returns how many bits differ between two tiles, over both planes. A      *
+ * pixel that changed in both planes counts twice.                          *
+ ****************************************************************************/
+int tile_distance(PICDATA *pic, unsigned int t0, unsigned int t1){
+	static const BYTE nibble_bits[16] = {0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4};
+	int i, d = 0, tdatasize = pic->tileh*2;
+	BYTE *a = &pic->tiles[t0*tdatasize], *b = &pic->tiles[t1*tdatasize], x;
+	for (i=0; i<tdatasize; i++){
+		x = a[i] ^ b[i];
+		d += nibble_bits[x & 0x0f] + nibble_bits[x >> 4];
+	}
+	return d;
+}
+
+/*** bk_find_nearest ********************************************************
+ * Looks for the tile in the BK-tree closest to 't', no further away than   *
+ * 'maxdist'. Only subtrees whose edge distance is within 'maxdist' of the  *
+ * distance to their parent can hold a match (triangle inequality), which   *
+ * keeps the search far from a full scan. Returns TILE_EMPTY if none found. *
+ ****************************************************************************/
+unsigned int bk_find_nearest(PICDATA *pic, BK_NODE *nodes, unsigned int root, unsigned int t, int maxdist, int *bestdist){
+	unsigned int *stack = (unsigned int *)arena_alloc(&jobArena, pic->total_tiles*sizeof(unsigned int));
+	unsigned int n, child, best = TILE_EMPTY;
+	int d, sp = 0;
+
+	*bestdist = maxdist + 1;
+	stack[sp++] = root;
+	while (sp){
+		n = stack[--sp];
+		d = tile_distance(pic, nodes[n].tile, t);
+		if (d <= maxdist && (d < *bestdist || (d == *bestdist && nodes[n].tile < best))){
+			*bestdist	= d;
+			best		= nodes[n].tile;
+		}
+		for (child = nodes[n].child; child != TILE_EMPTY; child = nodes[child].next){
+			if (nodes[child].dist >= d - maxdist && nodes[child].dist <= d + maxdist) stack[sp++] = child;
+		}
+	}
+	arena_free (stack);
+	return best;
+}
+
+/*** bk_insert **************************************************************
+ * Adds node 'n' (already filled with its tile) to the BK-tree.             *
+ ****************************************************************************/
+void bk_insert(PICDATA *pic, BK_NODE *nodes, unsigned int root, unsigned int n){
+	unsigned int cur = root, child;
+	int d;
+
+	nodes[n].child = nodes[n].next = TILE_EMPTY;
+	while (1){
+		d = tile_distance(pic, nodes[cur].tile, nodes[n].tile);
+		for (child = nodes[cur].child; child != TILE_EMPTY && nodes[child].dist != d; child = nodes[child].next);
+		if (child == TILE_EMPTY) break;
+		cur = child;
+	}
+	nodes[n].dist	= d;
+	nodes[n].next	= nodes[cur].child;
+	nodes[cur].child= n;
+}
+
+/*** do_lossy_reduction *****************************************************
+ * Merges tiles that differ from an earlier one in no more than 'maxdist'   *
+ * bits (see tile_distance). Tiles are visited in order, so every tile is   *
+ * either kept or replaced by the closest tile kept before it. Should run   *
+ * after do_tile_reduction, so exact duplicates are already gone.           *
+ ****************************************************************************/
+void do_lossy_reduction(PICDATA *pic, int maxdist){
+	if (!pic || !pic->total_tiles) return;
+
+	unsigned int t, match, kept = 1;
+	int c, d, old_tTiles = pic->total_tiles, mapsize = pic->cols*pic->rows;
+	unsigned int *remap = (unsigned int *)arena_alloc(&jobArena, old_tTiles*sizeof(unsigned int));
+	BK_NODE *nodes = (BK_NODE *)arena_alloc(&jobArena, old_tTiles*sizeof(BK_NODE));
+
+	/* The tree holds the kept tiles; node 'k' is kept tile 'k' */
+	nodes[0].tile	= 0;
+	nodes[0].child	= nodes[0].next = TILE_EMPTY;
+	remap[0]		= 0;
+	for (t=1; t<(unsigned int)old_tTiles; t++){
+		match = (t < (unsigned int)pic->base_tiles ? TILE_EMPTY : bk_find_nearest(pic, nodes, 0, t, maxdist, &d));
+		if (match != TILE_EMPTY){
+			remap[t] = match;
+			continue;
+		}
+		if (kept != t) copy_gb_tile(pic, kept, t);
+		nodes[kept].tile = kept;
+		bk_insert (pic, nodes, 0, kept);
+		remap[t] = kept++;
+	}
+	for (c=0; c<mapsize; c++) pic->tilemap[c] = remap[pic->tilemap[c]];
+
+	pic->total_tiles = kept;
+	arena_free (nodes);
+	arena_free (remap);
+	verbose ("-- %d similar tiles merged (up to %d bits apart). New tile count: %d\n", old_tTiles - pic->total_tiles, maxdist, pic->total_tiles);
+}
+
+/*** shade_cost_table *******************************************************
+ * Fills 'table' with the cost of showing one color where another one       *
+ * should be, for 4 pixels at a time: the index is made of the low and high *
+ * plane nibbles of tile A followed by the ones of tile B. Each pixel costs *
+ * the squared difference of the lightness of both colors, so a pixel going *
+ * from white to black weighs far more than two that drift one shade. The   *
+ * output palette is used when there is one; otherwise the 4 GB shades.     *
+ * Transparent sprite pixels are never a good stand-in for solid ones.      *
+ ****************************************************************************/
+void shade_cost_table(PICDATA *pic, int *table){
+	BYTE L[4] = {WHITE_VAL, LIGHTGRAY_VAL, DARKGRAY_VAL, BLACK_VAL};
+	int cost[4][4], a, b, r, g, bl, i, k;
+
+	if (globalOpts.create_palette){
+		for (a=0; a<4; a++){
+			r	= (pic->pal[a] & 0x1f) << 3;
+			g	= ((pic->pal[a] >> 5) & 0x1f) << 3;
+			bl	= ((pic->pal[a] >> 10) & 0x1f) << 3;
+			L[a] = color_light_val(r, g, bl);
+		}
+	}
+	for (a=0; a<4; a++){
+		for (b=0; b<4; b++){
+			cost[a][b] = (L[a] - L[b])*(L[a] - L[b]);
+			if (globalOpts.type == TARGET_SPRITE && a != b && (!a || !b)) cost[a][b] = 255*255;
+		}
+	}
+	for (i=0; i<65536; i++){
+		table[i] = 0;
+		for (k=0; k<4; k++){
+			a = ((i >> (12+k)) & 1) | (((i >> (8+k)) & 1) << 1);
+			b = ((i >> (4+k)) & 1) | (((i >> k) & 1) << 1);
+			table[i] += cost[a][b];
+		}
+	}
+}
+
+/*** tile_shade_distance ****************************************************
+ * Visible error of drawing tile 'b' in place of tile 'a' (see              *
+ * shade_cost_table).                                                       *
+ ****************************************************************************/
+long tile_shade_distance(PICDATA *pic, int *table, unsigned int a, unsigned int b){
+	BYTE *pa = &pic->tiles[a*pic->tileh*2], *pb = &pic->tiles[b*pic->tileh*2];
+	long d = 0;
+	int y;
+
+	for (y=0; y<pic->tileh; y++, pa+=2, pb+=2){
+		d += table[((pa[0] >> 4) << 12) | ((pa[1] >> 4) << 8) | ((pb[0] >> 4) << 4) | (pb[1] >> 4)];
+		d += table[((pa[0] & 15) << 12) | ((pa[1] & 15) << 8) | ((pb[0] & 15) << 4) | (pb[1] & 15)];
+	}
+	return d;
+}
+
+/*** nearest_budget_tile ****************************************************
+ * Finds the live tile closest to 't' and the cost of merging 't' into it   *
+ * (that distance times the map cells that show 't').                       *
+ ****************************************************************************/
+void nearest_budget_tile(PICDATA *pic, int *table, BUDGET_TILE *set, unsigned int t){
+	long d;
+	unsigned int u;
+
+	set[t].dist = -1;
+	for (u=0; u<(unsigned int)pic->total_tiles; u++){
+		if (u == t || !set[u].alive) continue;
+		d = tile_shade_distance(pic, table, t, u);
+		if (set[t].dist < 0 || d < set[t].dist){
+			set[t].dist		= d;
+			set[t].nearest	= u;
+		}
+	}
+	set[t].cost = set[t].dist * set[t].uses;
+}
+
+/*** fit_tile_budget ********************************************************
+ * Merges tiles until no more than 'budget' remain. This is a greedy        *
+ * agglomeration: every step folds the tile that is cheapest to lose (its   *
+ * distance to the closest surviving tile, weighted by how many map cells   *
+ * use it) into that tile. Surviving tiles are always tiles of the picture, *
+ * never blends, so nothing new shows up on screen.                         *
+ ****************************************************************************/
+void fit_tile_budget(PICDATA *pic, int budget){
+	if (!pic || pic->total_tiles <= budget) return;
+
+	int c, alive, old_tTiles = pic->total_tiles, mapsize = pic->cols*pic->rows;
+	unsigned int t, u, pick, kept = 0;
+	long worst = 0;
+	int *table = (int *)arena_alloc(&jobArena, 65536*sizeof(int));
+	BUDGET_TILE *set = (BUDGET_TILE *)arena_alloc(&jobArena, old_tTiles*sizeof(BUDGET_TILE));
+
+	shade_cost_table (pic, table);
+	for (t=0; t<(unsigned int)old_tTiles; t++){
+		set[t].alive	= 1;
+		set[t].uses		= 0;
+		set[t].owner	= t;
+	}
+	for (c=0; c<mapsize; c++){
+		if (pic->tilemap[c] != TILE_EMPTY) set[pic->tilemap[c]].uses++;
+	}
+	for (t=0; t<(unsigned int)old_tTiles; t++) nearest_budget_tile (pic, table, set, t);
+
+	for (alive = old_tTiles; alive > budget; alive--){
+		/* Tiles already in VRAM can't go away */
+		pick = TILE_EMPTY;
+		for (t=pic->base_tiles; t<(unsigned int)old_tTiles; t++){
+			if (set[t].alive && (pick == TILE_EMPTY || set[t].cost < set[pick].cost)) pick = t;
+		}
+		if (pick == TILE_EMPTY) break;
+		if (set[pick].cost > worst) worst = set[pick].cost;
+		u = set[pick].nearest;
+		set[pick].alive	= 0;
+		set[pick].owner	= u;
+		set[u].uses		+= set[pick].uses;
+		set[u].cost		= set[u].dist * set[u].uses;
+
+		/* Only the tiles that pointed at the one we dropped need to look for
+		a new closest tile; distances between the rest don't change */
+		for (t=0; t<(unsigned int)old_tTiles; t++){
+			if (set[t].alive && set[t].nearest == pick) nearest_budget_tile (pic, table, set, t);
+		}
+	}
+
+	/* Follow every merged tile to the survivor that ended up with its cells,
+	then compact the survivors keeping their order */
+	for (t=0; t<(unsigned int)old_tTiles; t++){
+		for (u = t; !set[u].alive; u = set[u].owner);
+		set[t].owner = u;
+	}
+	for (t=0; t<(unsigned int)old_tTiles; t++){
+		if (!set[t].alive) continue;
+		if (kept != t) copy_gb_tile(pic, kept, t);
+		set[t].nearest = kept++;
+	}
+	for (c=0; c<mapsize; c++){
+		if (pic->tilemap[c] != TILE_EMPTY) pic->tilemap[c] = set[set[pic->tilemap[c]].owner].nearest;
+	}
+
+	pic->total_tiles = kept;
+	arena_free (set);
+	arena_free (table);
+	verbose ("-- %d tiles merged to fit a budget of %d (worst merge cost %ld).\n", old_tTiles - pic->total_tiles, budget, worst);
+}
+
+/*** is_empty_tile **********************************************************
+ * Returns non-zero if every pixel of the tile is color 0 (which is always  *
+ * the transparent color for sprites).                                      *
+ ****************************************************************************/
+int is_empty_tile(PICDATA *pic, unsigned int t){
+	int i, tdatasize = pic->tileh*2;
+	BYTE *data = &pic->tiles[t*tdatasize];
+	for (i=0; i<tdatasize; i++) if (data[i]) return 0;
+	return 1;
+}
+
+/*** drop_empty_tiles *******************************************************
+ * Removes fully transparent tiles from PICDATA, keeping the order of the   *
+ * remaining ones. Map cells that used them are set to TILE_EMPTY.          *
+ ****************************************************************************/
+void drop_empty_tiles(PICDATA *pic){
+	if (!pic) return;
+
+	unsigned int *remap = (unsigned int *)arena_alloc(&jobArena, pic->total_tiles*sizeof(unsigned int));
+	int t, kept = 0, mapsize = pic->cols*pic->rows;
+
+	for (t=0; t<pic->total_tiles; t++){
+		if (t >= pic->base_tiles && is_empty_tile(pic, t)){
+			remap[t] = TILE_EMPTY;
+			continue;
+		}
+		if (kept != t) copy_gb_tile(pic, kept, t);
+		remap[t] = kept++;
+	}
+	for (t=0; t<mapsize; t++) pic->tilemap[t] = remap[pic->tilemap[t]];
+
+	verbose ("-- %d empty tiles dropped. New tile count: %d\n", pic->total_tiles - kept, kept);
+	pic->total_tiles = kept;
+	arena_free (remap);
+	if (!kept) error ("ERROR: The picture is fully transparent; there are no sprites to output.");
+}
 	
 /*###########################################################################
  ##                                                                        ##
  ##                        I M A G E   L O A D I N G                       ##
  ##                                                                        ##
  ###########################################################################*/
-/*** process_image *********************************************************
- * Loads and process a PNG, generating the tile and palette data that will *
- * be later output in code.                                                *
+/*** grow_workspace_buffer **************************************************
+ * Makes sure a decode workspace buffer holds at least 'size' bytes. Its    *
+ * contents are not kept.                                                   *
  ****************************************************************************/
-PICDATA *process_image(const char* filename){
-	unsigned int err, c;
-	unsigned char* image, *png;
-	unsigned int width, height;
-	int baseColor = 0;
-	long rgb;
-	PICDATA *result;
-	size_t pngsize;
-	LodePNGState state;
+void grow_workspace_buffer(const char *name, unsigned char **buffer, size_t *allocated, size_t size){
+	if (size <= *allocated) return;
+	free (*buffer);
+	*buffer = (unsigned char *)malloc(size);
+	if (!*buffer) error ("ERROR: Out of memory (requested %lu bytes).", (unsigned long)size);
+	*allocated = size;
+	verbose ("-- Decode workspace: %s buffer grown to %lu bytes\n", name, (unsigned long)size);
+}
 
-	lodepng_state_init(&state);
+/*** decode_workspace_release ***********************************************
+ * Gives the decode workspace buffers back to the heap.                     *
+ ****************************************************************************/
+void decode_workspace_release(void){
+	free (workspace.file);
+	free (workspace.buffers.idat);
+	free (workspace.buffers.scanlines);
+	free (workspace.buffers.image);
+	memset (&workspace, 0, sizeof(DECODE_WORKSPACE));
+}
 
-	/* ~~~~~~~~~~~~~~ STEP 1 ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
-	/* customize the PNG state to disable conversion and load the image. */
-	state.decoder.color_convert = 0;
-	lodepng_load_file(&png, &pngsize, filename);
-	err = lodepng_decode(&image, &width, &height, &state, png, pngsize);
-	free(png);
-	if(err) error("ERROR %u: %s\n", err, lodepng_error_text(err));
+/*** load_stage *************************************************************
+ * First stage of the conversion: reads the PNG file into the workspace.    *
+ ****************************************************************************/
+void load_stage(PNG_JOB *job){
+	long size;
+	FILE *f = fopen(job->filename, "rb");
+
+	if (!f) error ("ERROR 78: failed to open file for reading (%s)\n", job->filename);
+	fseek (f, 0, SEEK_END);
+	size = ftell(f);
+	rewind (f);
+	if (size < 0) error ("ERROR: Couldn't read %s\n", job->filename);
+
+	grow_workspace_buffer ("file", &workspace.file, &workspace.filesize, size ? size : 1);
+	job->png		= workspace.file;
+	job->pngsize	= fread(job->png, 1, size, f);
+	fclose (f);
+	if (job->pngsize != (size_t)size) error ("ERROR: Couldn't read %s\n", job->filename);
+}
 
+/*** pack_setup *************************************************************
+ * Maps the palette and allocates the picture the pixels will be packed in. *
+ * Runs once the PNG chunks have been read, right before the first strip of *
+ * pixels is packed.                                                        *
+ ****************************************************************************/
+void pack_setup(PNG_JOB *job){
+	unsigned int c;
+	unsigned int width = job->width, height = job->height;
+	LodePNGState *state = &job->state;
+	int baseColor = 0;
+	long rgb;
+	PICDATA *result;
 
 	/*We can now make use of both state and image data */
-	int tColors = state.info_png.color.palettesize;
+	int tColors = state->info_png.color.palettesize;
 	/*
 	verbose("image size  : %dx%d\n", width, height);
-	verbose("color type  : %d\n", state.info_png.color.colortype);
-	verbose("color depth : %d\n", state.info_png.color.bitdepth);
+	verbose("color type  : %d\n", state->info_png.color.colortype);
+	verbose("color depth : %d\n", state->info_png.color.bitdepth);
 	verbose("color count : %d\n", tColors);
 	*/
 
-	if (state.info_png.color.colortype != LCT_PALETTE) error ("ERROR: PNG colortype 3 (indexed, 256 colors max) expected!");
+	if (state->info_png.color.colortype != LCT_PALETTE) error ("ERROR: PNG colortype 3 (indexed, 256 colors max) expected!");
 
 	if (tColors > 4 && !globalOpts.grayscale){
 		error ("ERROR: PNG has more than 4 colors! Select grayscale conversion (-g) and try again.\n\n");
@@ -415,19 +955,19 @@ PICDATA *process_image(const char* filename){
 	/* palette[] will contain a copy of the image palette but with additional
 	info such as the light intensity of  each color. This data will later be
 	used to sort the palette or perform grayscale conversion */
-	RGB_PALETTE_ENTRY *palette = (RGB_PALETTE_ENTRY *)malloc(tColors*sizeof(RGB_PALETTE_ENTRY));
+	RGB_PALETTE_ENTRY *palette = (RGB_PALETTE_ENTRY *)arena_alloc(&jobArena, tColors*sizeof(RGB_PALETTE_ENTRY));
 
 	/* palette_map[] on the other hand will map any color from the full palette
 	to the first 4 entries. It will be initialized first with a 1:1 mapping
 	but will be later edited for color sorting and grayscale conversion */
-	unsigned char *palette_map = (unsigned char *)malloc(tColors);
+	unsigned char *palette_map = (unsigned char *)arena_alloc(&jobArena, tColors);
 
 	verbose ("\n<ANALYZING COLORS>\n");
 	for (c=0; c<tColors; c++){
 		set_palette_color(&palette[c],
-			(unsigned char)state.info_png.color.palette[c*4], 	/* R */
-			(unsigned char)state.info_png.color.palette[c*4+1],	/* G */
-			(unsigned char)state.info_png.color.palette[c*4+2]	/* B */
+			(unsigned char)state->info_png.color.palette[c*4], 	/* R */
+			(unsigned char)state->info_png.color.palette[c*4+1],	/* G */
+			(unsigned char)state->info_png.color.palette[c*4+2]	/* B */
 		);
 		/* initial 1:1 mapping */
 		palette_map[c] = c;
@@ -469,7 +1009,7 @@ PICDATA *process_image(const char* filename){
 			}
 		}
 		/* Overwrite the existing palette with a GB-compatible one */
-		free(palette);
+		arena_free(palette);
 		palette = create_gb_gray_pal();
 		tColors = 4;
 	}else {
@@ -490,7 +1030,7 @@ PICDATA *process_image(const char* filename){
 			verbose ("-- RE-ARRANGING THE PALETTE FROM LIGHT TO DARK\n");
 			if (tColors < 4){
 				/* Resize the palette to 4 colors */
-				palette = (RGB_PALETTE_ENTRY *)realloc (palette, 4*sizeof(RGB_PALETTE_ENTRY));
+				palette = (RGB_PALETTE_ENTRY *)arena_realloc (&jobArena, palette, 4*sizeof(RGB_PALETTE_ENTRY));
 	
 				/* fill the new entries with a dummy color (let's use black) */
 				memset (&palette[tColors], 0, sizeof(RGB_PALETTE_ENTRY)*(4-tColors));
@@ -525,6 +1065,14 @@ PICDATA *process_image(const char* filename){
 	result = allocate_gb_pict (width, height, (is8x16Mode() ? 1 : 0));
 	verbose("input tiles: %d (%dx%d map)\n\n", result->rows*result->cols, result->cols, result->rows);
 
+	/* Animation sheets are sliced while packing, so the whole sheet is only
+	decoded once and tile reduction works across every frame. */
+	int frames_across = 0;
+	if (globalOpts.frame_w){
+		frames_across = slice_gb_frames (result, globalOpts.frame_w, globalOpts.frame_h);
+		verbose("-- %d frames of %dx%d tiles (%d per row)\n\n", result->frames, result->cols, result->rows / result->frames, frames_across);
+	}
+
 	if (globalOpts.create_palette){
 		verbose ("\n<GENERATING OUTPUT PALETTE>\n");
 		verbose ("-- Palette Data\n");
@@ -537,45 +1085,299 @@ PICDATA *process_image(const char* filename){
 		}
 	}
 
-	/* ~~~~~~~~~~~~~~ STEP 5 ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
-	/* go over the pixel data */
+	if (width % 8 == 0){
+		verbose ("-- Packing %d bpp pixels with a lookup table\n", state->info_png.color.bitdepth);
+		build_pack_tables (job->lut_lo, job->lut_hi, state->info_png.color.bitdepth, palette_map, state->info_png.color.palettesize);
+	}
+
+	job->result			= result;
+	job->palette		= palette;
+	job->palette_map	= palette_map;
+	job->frames_across	= frames_across;
+}
+
+/*** pack_strip *************************************************************
+ * Packs 'rows' decoded rows of pixels, from row 'y' on, into GB tiles.     *
+ * The decoder calls it for every row of tiles as soon as it's inflated and *
+ * unfiltered, while it inflates the rest (or once with the whole image if  *
+ * the PNG is interlaced).                                                  *
+ ****************************************************************************/
+void pack_strip(unsigned y, unsigned rows, const unsigned char *image, void *user){
+	PNG_JOB *job = (PNG_JOB *)user;
+	PICDATA *result;
 	unsigned char pdata;
-	int x, y, tx, ty, b, pix;
-	int ppb = 8/state.info_png.color.bitdepth; /* pixels per byte */
-	long tBytes = width*height/ppb;
-	int tile_n = 0;
+	int x, py, tx, ty, pix, tile_n;
+	int width = job->width, bitdepth = job->state.info_png.color.bitdepth;
+	int ppb = 8/bitdepth; /* pixels per byte */
+	long b, first = (long)y*width/ppb, last = (long)(y + rows)*width/ppb;
 
-	for (b=0; b<tBytes; b++){
+	if (!job->result) pack_setup(job);
+	result = job->result;
+
+	/* ~~~~~~~~~~~~~~ STEP 5 ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+	/* go over the pixel data */
+	if (width % 8 == 0){
+		/*	Every row of a tile is 'bitdepth' whole bytes of the image, so it
+			can be built a byte at a time from a table (see pack_tile_rows) */
+		pack_tile_rows (result, image, width, y, rows, bitdepth, job->lut_lo, job->lut_hi, job->frames_across);
+	}else for (b=first; b<last; b++){
 		pdata = image[b];
 		for (pix=0; pix<ppb; pix++){
 			x = (b*ppb + pix) % width; /* Current pixel in the picture = b*ppb + pix */
-			y = (b*ppb + pix) / width;
+			py = (b*ppb + pix) / width;
 			tx = x / 8;
-			ty = y / result->tileh;
-			tile_n = ty*result->cols + tx;
-			set_tile_pixel (result, tile_n, x % 8, y % result->tileh, palette_map[pdata>>(8-state.info_png.color.bitdepth)]);
-			pdata <<= state.info_png.color.bitdepth;
+			ty = py / result->tileh;
+			tile_n = sheet_tile_index (result, tx, ty, job->frames_across);
+			set_tile_pixel (result, tile_n, x % 8, py % result->tileh, job->palette_map[pdata>>(8-bitdepth)]);
+			pdata <<= bitdepth;
+		}
+	}
+}
+
+/*** decode_stage ***********************************************************
+ * Second stage: decodes the PNG, keeping the pixels as palette indexes.    *
+ * The header tells how big the image is, so the workspace can be made big  *
+ * enough before inflating, unfiltering and deinterlacing into it.          *
+ ****************************************************************************/
+void decode_stage(PNG_JOB *job){
+	LodePNGDecodeBuffers need;
+	LodePNGDecodeBuffers *ws = &workspace.buffers;
+	unsigned int err;
+
+	/* The decoded image about to be overwritten can't be reused anymore */
+	workspace.source[0] = '\0';
+
+	lodepng_state_init(&job->state);
+	err = lodepng_inspect(&job->width, &job->height, &job->state, job->png, job->pngsize);
+	if(err) error("ERROR %u: %s\n", err, lodepng_error_text(err));
+
+	lodepng_decode_buffer_sizes (&need, job->width, job->height, &job->state.info_png, job->pngsize);
+	grow_workspace_buffer ("IDAT", &ws->idat, &ws->idatsize, need.idatsize);
+	grow_workspace_buffer ("scanline", &ws->scanlines, &ws->scanlinessize, need.scanlinessize);
+	grow_workspace_buffer ("image", &ws->image, &ws->imagesize, need.imagesize);
+
+	/* Every row of tiles is packed as soon as it's inflated and unfiltered,
+	while it's still in the cache (unless only a region of the picture is converted;
+	see pack_image). No color conversion: the pixels are kept as they are
+	in the PNG. */
+	ws->strip_callback	= (globalOpts.rect_w ? NULL : pack_strip);
+	ws->strip_rows		= (is8x16Mode() ? 16 : 8);
+	ws->strip_user		= job;
+	err = lodepng_decode_into(ws, &job->width, &job->height, &job->state, job->png, job->pngsize);
+	job->png = NULL;
+	if(err) error("ERROR %u: %s\n", err, lodepng_error_text(err));
+	job->image = ws->image;
+}
+
+/*** remember_decoded_image *************************************************
+ * Keeps what's needed to reuse the image just decoded for later jobs on    *
+ * the same file (see reuse_decoded_image).                                 *
+ ****************************************************************************/
+void remember_decoded_image(PNG_JOB *job){
+	LodePNGColorMode *color = &job->state.info_png.color;
+	struct stat st;
+
+	if (stat(job->filename, &st) || color->palettesize > 256) return;
+	snprintf (workspace.source, sizeof(workspace.source), "%s", job->filename);
+	workspace.mtime			= st.st_mtime;
+	workspace.size			= (long)st.st_size;
+	workspace.width			= job->width;
+	workspace.height		= job->height;
+	workspace.colortype		= color->colortype;
+	workspace.bitdepth		= color->bitdepth;
+	workspace.palettesize	= color->palettesize;
+	memcpy (workspace.palette, color->palette, color->palettesize*4);
+}
+
+/*** reuse_decoded_image ****************************************************
+ * If the image in the workspace was decoded from the same (unchanged) file *
+ * sets the job up to use it as if it had just been decoded, and returns    *
+ * != 0. Several regions of one atlas only decode it once this way.         *
+ ****************************************************************************/
+int reuse_decoded_image(PNG_JOB *job){
+	LodePNGColorMode *color = &job->state.info_png.color;
+	struct stat st;
+	size_t c;
+
+	if (!workspace.source[0] || strcmp(workspace.source, job->filename)) return 0;
+	if (stat(job->filename, &st) || st.st_mtime != workspace.mtime || (long)st.st_size != workspace.size) return 0;
+
+	lodepng_state_init(&job->state);
+	color->colortype	= workspace.colortype;
+	color->bitdepth		= workspace.bitdepth;
+	for (c=0; c<workspace.palettesize; c++){
+		lodepng_palette_add (color, workspace.palette[c*4], workspace.palette[c*4+1], workspace.palette[c*4+2], workspace.palette[c*4+3]);
+	}
+	job->width	= workspace.width;
+	job->height	= workspace.height;
+	job->image	= workspace.buffers.image;
+	verbose ("-- Reusing the decoded image of %s\n", job->filename);
+	return 1;
+}
+
+/*** crop_image *************************************************************
+ * Copies the region of the picture selected with -rect out of the decoded  *
+ * image (packed the same way: rows one after another, without padding).    *
+ * The job is left with the region size. Returns the copy (allocated in     *
+ * the job arena).                                                          *
+ ****************************************************************************/
+BYTE *crop_image(PNG_JOB *job){
+	int bitdepth = job->state.info_png.color.bitdepth;
+	int x, y, pix, mask = (1 << bitdepth) - 1;
+	long size = ((long)globalOpts.rect_w*globalOpts.rect_h*bitdepth + 7)/8;
+	long in, out = 0;
+	BYTE *region;
+
+	if (globalOpts.rect_x + globalOpts.rect_w > (int)job->width || globalOpts.rect_y + globalOpts.rect_h > (int)job->height){
+		error ("ERROR: The region %dx%d at %d,%d is outside of the picture (%ux%u).", globalOpts.rect_w, globalOpts.rect_h, globalOpts.rect_x, globalOpts.rect_y, job->width, job->height);
+	}
+
+	region = (BYTE *)arena_alloc(&jobArena, size);
+	memset (region, 0, size);
+	for (y=0; y<globalOpts.rect_h; y++){
+		in = ((long)(globalOpts.rect_y + y)*job->width + globalOpts.rect_x)*bitdepth;
+		if (bitdepth == 8){
+			memcpy (&region[out/8], &job->image[in/8], globalOpts.rect_w);
+			out += globalOpts.rect_w*8;
+			continue;
 		}
+		/* Pixels are packed MSB first, as in the PNG */
+		for (x=0; x<globalOpts.rect_w; x++, in += bitdepth, out += bitdepth){
+			pix = (job->image[in/8] >> (8 - bitdepth - in%8)) & mask;
+			region[out/8] |= pix << (8 - bitdepth - out%8);
+		}
+	}
+
+	job->width	= globalOpts.rect_w;
+	job->height	= globalOpts.rect_h;
+	return region;
+}
+
+/*** pack_image *************************************************************
+ * Packs the whole decoded image (or the -rect region of it) at once, for   *
+ * jobs whose pixels weren't packed while decoding.                         *
+ ****************************************************************************/
+void pack_image(PNG_JOB *job){
+	const BYTE *image = job->image;
+	if (globalOpts.rect_w) image = crop_image(job);
+	pack_strip (0, job->height, image, job);
+}
+
+/*** reduce_stage ***********************************************************
+ * Last stage: once every pixel is packed, reduces the tile set and frees   *
+ * what's left of the decoding.                                             *
+ ****************************************************************************/
+PICDATA *reduce_stage(PNG_JOB *job){
+	PICDATA *result = job->result;
+
+	if (globalOpts.base_tileset[0]){
+		verbose ("\n<LOADING BASE TILES>\n");
+		load_base_tiles(result, globalOpts.base_tileset);
 	}
 
 	if (globalOpts.tile_reduction){
 		verbose ("\n<PERFORMING TILE REDUCTION>\n");
-		do_tile_reduction(result);
+		if (!globalOpts.incremental[0] || !incremental_reduction(result, globalOpts.incremental)) do_tile_reduction(result);
+		if (globalOpts.lossy_bits) do_lossy_reduction(result, globalOpts.lossy_bits);
+	}
+
+	if (globalOpts.metasprite && globalOpts.type == TARGET_SPRITE){
+		verbose ("\n<DROPPING EMPTY SPRITE TILES>\n");
+		drop_empty_tiles(result);
+	}
+
+	if (globalOpts.tile_budget > 0 && result->total_tiles > globalOpts.tile_budget){
+		verbose ("\n<FITTING THE TILE BUDGET>\n");
+		fit_tile_budget(result, globalOpts.tile_budget);
+	}
+
+	if (globalOpts.tiledb[0]){
+		verbose ("\n<MAPPING TILES TO THE TILE DATABASE>\n");
+		tiledb_apply(result, globalOpts.tiledb);
+	}
+
+	if (globalOpts.incremental[0]){
+		verbose ("\n<SAVING THE TILES FOR THE NEXT RUN>\n");
+		incremental_save(result, globalOpts.incremental);
 	}
 
 	/* ~~~~~~~~~~~~~~ STEP 6 ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
-	lodepng_state_cleanup(&state);
-	free(image);
-	free(palette);
-	free(palette_map);
+	/* Everything else lives in the job arena and will be released in one go
+	once the output has been written. The image stays in the workspace. */
+	lodepng_state_cleanup(&job->state);
+	arena_free(job->palette_map);
+	arena_free(job->palette);
 	return result;
 }
 
+/*** process_image *********************************************************
+ * Loads and process a PNG, generating the tile and palette data that will *
+ * be later output in code.                                                *
+ ****************************************************************************/
+PICDATA *process_image(const char* filename){
+	PNG_JOB job;
+	memset (&job, 0, sizeof(PNG_JOB));
+	job.filename = filename;
+
+	if (!reuse_decoded_image(&job)){
+		load_stage (&job);
+		decode_stage (&job);
+		remember_decoded_image (&job);
+	}
+	if (!job.result) pack_image (&job);
+	return reduce_stage (&job);
+}
+
+/*** process_png_data *******************************************************
+ * Same as process_image(), for a PNG that is already in memory ('filename' *
+ * is only used in messages).                                               *
+ ****************************************************************************/
+PICDATA *process_png_data(const char* filename, const BYTE *png, size_t size){
+	PNG_JOB job;
+	memset (&job, 0, sizeof(PNG_JOB));
+	job.filename	= filename;
+	job.png			= (BYTE *)png;
+	job.pngsize		= size;
+
+	decode_stage (&job);
+	if (!job.result) pack_image (&job);
+	return reduce_stage (&job);
+}
+
 /*###########################################################################
  ##                                                                        ##
  ##                   O U T P U T   G E N E R A T I O N                    ##
  ##                                                                        ##
  ###########################################################################*/
+/*** count_meta_sprites *****************************************************
+ * Returns how many hardware sprites a frame of the metasprite uses.        *
+ ****************************************************************************/
+int count_meta_sprites(PICDATA *gbpic, int frame){
+	int t, count = 0, fsize = gbpic->cols*gbpic->rows/gbpic->frames;
+	for (t=frame*fsize; t<(frame+1)*fsize; t++) if (gbpic->tilemap[t] != TILE_EMPTY) count++;
+	return count;
+}
+
+/*** split_vram_banks *******************************************************
+ * GBC BG tiles (-V): if the tile set doesn't fit in VRAM bank 0 from the   *
+ * base index on, the last tiles of the set go to bank 1, at the same       *
+ * indexes. The tiles to upload are split evenly between both banks, so     *
+ * neither of them takes longer to load than it has to.                     *
+ ****************************************************************************/
+void split_vram_banks(PICDATA *gbpic){
+	int room = 256 - globalOpts.baseindex;
+
+	gbpic->bank1_tiles = 0;
+	if (gbpic->total_tiles <= room) return;
+
+	/* Bank 0 gets the odd tile out, unless -base-tiles already filled it up */
+	gbpic->bank1_tiles = (gbpic->total_tiles - gbpic->base_tiles)/2;
+	if (gbpic->total_tiles - gbpic->bank1_tiles > room) gbpic->bank1_tiles = gbpic->total_tiles - room;
+	verbose ("-- VRAM banks: %d tiles in bank 0, %d in bank 1\n", gbpic->total_tiles - gbpic->base_tiles - gbpic->bank1_tiles, gbpic->bank1_tiles);
+
+	if (gbpic->bank1_tiles > room) printf("\nWARNING: The %d tiles don't fit in VRAM banks 0 and 1 from base index %d\n\t(%d tiles each). The tile indexes will wrap around.\n", gbpic->total_tiles, globalOpts.baseindex, room);
+}
+
 /*** gb_check_warnings ******************************************************
  * Checks that the generated data and selected options are well within the  *
  * limits of the Gameboy. Will adjust values if possible.                   *
@@ -590,30 +1392,135 @@ void gb_check_warnings(PICDATA *gbpic){
 		globalOpts.palnumber = 7;
 	}
 
+	if ((globalOpts.compress_tiles || globalOpts.compress_map) && (globalOpts.lz_level < LZ_LEVEL_GREEDY || globalOpts.lz_level > LZ_LEVEL_OPTIMAL)){
+		printf("\nWARNING: Compression level must be 1 (greedy) or 2 (optimal). Greedy\n\tparsing will be used.\n");
+		globalOpts.lz_level = LZ_LEVEL_GREEDY;
+	}
+
+	if ((globalOpts.vram_loader || globalOpts.stream_slots) && (globalOpts.vblank_tiles < 1 || globalOpts.vblank_tiles > 128)){
+		globalOpts.vblank_tiles = VBLANK_CPU_TILES;
+		printf("\nWARNING: The VBlank batch must be between 1 and 128 tiles. %d will be used.\n", globalOpts.vblank_tiles);
+	}
+
 	if (globalOpts.big_sprite && (globalOpts.baseindex & 1)){
 		globalOpts.baseindex &= 0xfe;
 		printf("\nNOTICE: In 8x16 mode base index must be even. Base will be rounded to %d.\n", globalOpts.baseindex);
 	}
 
+	if (globalOpts.compress_map && globalOpts.type == TARGET_SPRITE){
+		printf("\nNOTICE: Map compression only applies to BKG and WIN data. Sprite maps\n\tand attributes will be output uncompressed.\n");
+		globalOpts.compress_map = 0;
+	}
+
+	if (globalOpts.metasprite && globalOpts.type != TARGET_SPRITE){
+		printf("\nNOTICE: Metasprites only apply to sprite data and will be ignored.\n");
+		globalOpts.metasprite = 0;
+	}
+
+	if (globalOpts.large_map && globalOpts.type != TARGET_BKG){
+		printf("\nNOTICE: The large map mode only applies to BKG data and will be ignored.\n");
+		globalOpts.large_map = 0;
+	}
+
+	if (globalOpts.large_map && globalOpts.frame_w){
+		printf("\nNOTICE: The large map mode can't be used with animation frames and will\n\tbe ignored.\n");
+		globalOpts.large_map = 0;
+	}
+
+	if (globalOpts.large_map && globalOpts.compress_map){
+		printf("\nNOTICE: Map streaming needs random access to the map, so map compression\n\thas been disabled.\n");
+		globalOpts.compress_map = 0;
+	}
+
+	if (globalOpts.large_map && !globalOpts.create_map){
+		printf("\nNOTICE: The large map mode requires the tilemap, so the tilemap output\n\toption has been activated.\n");
+		globalOpts.create_map = 1;
+	}
+
 	if (globalOpts.test_code && !globalOpts.create_map){
 		printf("\nNOTICE: For the test code to work, the tilemap output option has been\n\tactivated despite not being selected.\n");
 		globalOpts.create_map = 1;
 	}
 
+	if (globalOpts.vram_bank1 && globalOpts.type == TARGET_SPRITE){
+		printf("\nNOTICE: VRAM bank 1 tiles (-V) only apply to BKG and WIN data and will be\n\tignored.\n");
+		globalOpts.vram_bank1 = 0;
+	}
+
 	if (globalOpts.sort_palette && !globalOpts.create_palette){
 		printf("\nNOTICE: Palette sorting is activated but palette output is\n\tdisabled, so it will be enabled now.\n");
 		globalOpts.create_map = 1;
 	}
 
+	if (globalOpts.rom_bank < 0 || globalOpts.rom_bank > ROM_BANK_LAST){
+		printf("\nWARNING: The ROM bank must be between 1 and %d. Bank 1 will be used.\n", ROM_BANK_LAST);
+		globalOpts.rom_bank = 1;
+	}
+
+	if (globalOpts.rom_bank){
+		/* Only raw data is split between banks; compressed streams must fit in one */
+		int mapsplit = (!globalOpts.compress_map && gbpic->cols*gbpic->rows > ROM_BANK_SIZE);
+		int split = (!globalOpts.compress_tiles && !globalOpts.stream_slots && (gbpic->total_tiles - gbpic->base_tiles)*gbpic->tileh*2 > ROM_BANK_SIZE);
+		split |= (globalOpts.create_map && mapsplit);
+		if (mapsplit && globalOpts.large_map){
+			printf("\nNOTICE: The map is too large for a single ROM bank, which the streaming\n\tcode needs. The large map mode has been disabled.\n");
+			globalOpts.large_map = 0;
+		}
+		if (split && globalOpts.test_code){
+			printf("\nNOTICE: The data is split between ROM banks, which the test code can't\n\thandle. The test code has been disabled.\n");
+			globalOpts.test_code = 0;
+		}
+	}
+
+	if (globalOpts.stream_slots){
+		int room = (256 - globalOpts.baseindex)*(globalOpts.vram_bank1 ? 2 : 1);
+		if (!globalOpts.large_map){
+			printf("\nNOTICE: Tile streaming (-slots) only applies to the large map mode and\n\twill be ignored.\n");
+			globalOpts.stream_slots = 0;
+		}else if (globalOpts.stream_slots > room){
+			printf("\nWARNING: There are only %d VRAM slots from base index %d%s.\n\tAll of them will be used.\n", room, globalOpts.baseindex, (globalOpts.vram_bank1 ? " in banks 0 and 1" : ""));
+			globalOpts.stream_slots = room;
+		}
+	}
+
+	if (globalOpts.stream_slots && gbpic->total_tiles <= globalOpts.stream_slots){
+		printf("\nNOTICE: The %d tiles fit in the %d VRAM slots, so they won't be streamed.\n", gbpic->total_tiles, globalOpts.stream_slots);
+		globalOpts.stream_slots = 0;
+	}
+
+	if (globalOpts.stream_slots && globalOpts.compress_tiles){
+		printf("\nNOTICE: Tile streaming needs random access to the tiles, so tile\n\tcompression has been disabled.\n");
+		globalOpts.compress_tiles = 0;
+	}
+
+	if (globalOpts.stream_slots && globalOpts.vram_loader){
+		printf("\nNOTICE: Streamed tiles are loaded as the camera moves, so the VRAM loader\n\thas been disabled.\n");
+		globalOpts.vram_loader = 0;
+	}
+
+	/* Every index and attribute output from here on depends on the split */
+	if (globalOpts.stream_slots) stream_plan(gbpic, globalOpts.stream_slots);
+	else if (globalOpts.vram_bank1) split_vram_banks(gbpic);
+	else if (gbpic->total_tiles*(gbpic->tileh/8) + globalOpts.baseindex > 256){
+		/* Tile indexes are output as bytes (see gb_cell_tile) */
+		printf("\nWARNING: The %d tiles don't fit in the 256 VRAM tile indexes from base\n\tindex %d. The tile indexes will wrap around.", gbpic->total_tiles, globalOpts.baseindex);
+		if (globalOpts.type == TARGET_SPRITE) printf("\n");
+		else printf(" Try GBC VRAM bank 1 (-V)\n\tor streaming the tiles (-slots).\n");
+	}
+
 	if (globalOpts.test_code){
+		/* The sample code only shows one frame at a time */
+		int rows = gbpic->rows / gbpic->frames;
+		if (globalOpts.compress_tiles && (gbpic->total_tiles - gbpic->base_tiles)*gbpic->tileh*2 > 6144) printf("\nWARNING: The decompressed tile data is more than 6KB in size.\n\tThe test code buffer may not fit in RAM.\n");
 		if (globalOpts.type == TARGET_BKG || globalOpts.type == TARGET_WINDOW){
 			char func_name[4];
 			strcpy(func_name, (globalOpts.type == TARGET_BKG ? "bkg": "win"));
-			if (gbpic->cols > 32 || gbpic->rows > 32) printf("\nWARNING: The image is more than 32x32 tiles in size.\n\tThe set_%s_tiles() calls will most probably\n\toverflow.\n", func_name);
-			if (gbpic->total_tiles + globalOpts.baseindex > 256) printf("\nWARNING: There are more than 256 tiles in %s_dat[]\n\tor the chosen base index is too high. This may\n\tcause problems with set_%s_data().\n", globalOpts.name, func_name);
+			if (!globalOpts.large_map && (gbpic->cols > 32 || rows > 32)) printf("\nWARNING: The image is more than 32x32 tiles in size.\n\tThe set_%s_tiles() calls will most probably\n\toverflow. Try the large map mode (-L).\n", func_name);
 		} else {
 			if (gbpic->total_tiles + globalOpts.baseindex > 40) printf("\nWARNING: There are more than 40 frames in %s_dat[]\n\tor the chosen base index is too high. This may\n\tcause problems with set_sprite_data().\n", globalOpts.name);
-			if (gbpic->cols*gbpic->rows > 40 || gbpic->cols > 10) printf("\nWARNING: The picture is more than 40 sprites in size or\n\tmore than 10 sprites wide. The sample code won't\n\tdisplay correctly.\n", globalOpts.name);
+			if (globalOpts.metasprite){
+				if (count_meta_sprites(gbpic, 0) > 40) printf("\nWARNING: The metasprite needs more than 40 hardware sprites.\n\tThe sample code won't display correctly.\n");
+			}else if (gbpic->cols*rows > 40 || gbpic->cols > 10) printf("\nWARNING: The picture is more than 40 sprites in size or\n\tmore than 10 sprites wide. The sample code won't\n\tdisplay correctly.\n", globalOpts.name);
 		}
 	}
 }
@@ -636,31 +1543,513 @@ void code_disclaimer_c(char *inputfile, char *outputfile, FILE *f){
 	fputs	(" *********************************************************************/\n\n", f);
 }
 
+/*** gbdk_decl_file *********************************************************
+ * Returns where #defines, types and declarations go: the header in split   *
+ * output mode (-H), otherwise the code file itself.                        *
+ ****************************************************************************/
+FILE *gbdk_decl_file(FILE *f){
+	return (declFile ? declFile : f);
+}
+
+/*** gbdk_decl_output *******************************************************
+ * Starts the definition of a global (array, variable or function), given   *
+ * its declarator printf-style. In split output mode the header also gets   *
+ * an extern declaration for it.                                            *
+ ****************************************************************************/
+void gbdk_decl_output(FILE *f, const char *format, ...){
+	char decl[512];
+	va_list args;
+
+	va_start (args, format);
+	vsnprintf (decl, sizeof(decl), format, args);
+	va_end (args);
+	fputs (decl, f);
+	if (declFile) fprintf (declFile, "extern %s;\n", decl);
+}
+
+/*** gb_cell_vram_entry *****************************************************
+ * Returns which tile of VRAM (counting from the base index, bank 0 first)  *
+ * a BG/WIN map cell shows: its own, or the slot its tile is streamed to.   *
+ * 'first1' gets the first one that lives in GBC VRAM bank 1.               *
+ ****************************************************************************/
+unsigned int gb_cell_vram_entry(PICDATA *gbpic, int cell, unsigned int *first1){
+	if (gbpic->tile_slot){
+		/* Slots past the first bank are the same indexes in bank 1 */
+		*first1 = 256 - globalOpts.baseindex;
+		return gbpic->tile_slot[gbpic->tilemap[cell]];
+	}
+	*first1 = gbpic->total_tiles - gbpic->bank1_tiles;
+	return gbpic->tilemap[cell];
+}
+
+/*** gb_cell_attribute ******************************************************
+ * Returns the attribute byte for a map cell (or a tile, for sprites).      *
+ ****************************************************************************/
+BYTE gb_cell_attribute(PICDATA *gbpic, int cell){
+	unsigned int first1;
+	/* Bit 3 tells the GBC which VRAM bank the BG tile is in */
+	if ((gbpic->bank1_tiles || gbpic->tile_slot) && gb_cell_vram_entry(gbpic, cell, &first1) >= first1) return globalOpts.palnumber | 0x08;
+	return globalOpts.palnumber;
+}
+
+/*** gb_cell_tile ***********************************************************
+ * Returns the tile index byte for a BG/WIN map cell: the VRAM index of its *
+ * tile, within the VRAM bank that holds it.                                *
+ ****************************************************************************/
+BYTE gb_cell_tile(PICDATA *gbpic, int cell){
+	unsigned int first1, t = gb_cell_vram_entry(gbpic, cell, &first1);
+	if (t >= first1) t -= first1;
+	return (BYTE)(globalOpts.baseindex + t);
+}
+
+/*** c_byte_array_output ****************************************************
+ * Outputs a block of bytes as the contents of a C array, 16 per line.      *
+ ****************************************************************************/
+void c_byte_array_output(BYTE *data, size_t len, FILE *f){
+	size_t i;
+	/* C doesn't allow empty arrays */
+	if (!len) fputs ("\n\t0x00", f);
+	for (i=0; i<len; i++){
+		if (i % 16 == 0) fputs ("\n\t", f);
+		fprintf (f, "0x%02x", data[i]);
+		if (i < len-1) fputs (", ", f);
+	}
+	fputs ("\n};\n\n", f);
+}
+
+/*** gbdk_data_array_output *************************************************
+ * Outputs the name_suffix[] data array. In ROM bank mode the data goes to  *
+ * the bank files instead (split in chunks of 'unit' bytes if needed, see   *
+ * banks.c) and only its declaration is output here.                        *
+ ****************************************************************************/
+void gbdk_data_array_output(const char *suffix, BYTE *data, size_t len, size_t unit, int group, FILE *f){
+	char symbol[280];
+	snprintf (symbol, sizeof(symbol), "%s_%s", globalOpts.name, suffix);
+	if (globalOpts.rom_bank){
+		gbdk_bank_externs_output (bank_add_asset(symbol, data, len, unit, group), f);
+		return;
+	}
+	gbdk_decl_output (f, "const unsigned char %s[]", symbol);
+	fputs (" = {", f);
+	c_byte_array_output (data, len, f);
+}
+
+/*** gbdk_bank_switch_output ************************************************
+ * In ROM bank mode, outputs a line that switches to the bank holding the   *
+ * name_suffix[] array.                                                     *
+ ****************************************************************************/
+void gbdk_bank_switch_output(const char *suffix, const char *indent, FILE *f){
+	if (globalOpts.rom_bank) fprintf (f, "%sSWITCH_ROM_MBC1(%s_%s_bank);\n", indent, globalOpts.name, suffix);
+}
+
+/*** gbdk_compressed_tiles_output *******************************************
+ * Outputs tiles 'first' to 'last'-1 as the LZ compressed stream            *
+ * name_suffix[] (see compress.c).                                          *
+ ****************************************************************************/
+void gbdk_compressed_tiles_output(PICDATA *gbpic, const char *suffix, int first, int last, FILE *f){
+	size_t rawsize = (last - first)*gbpic->tileh*2;
+	BYTE *packed = (BYTE *)arena_alloc(&jobArena, lz_bound(rawsize));
+	size_t packedsize = lz_compress(&gbpic->tiles[first*gbpic->tileh*2], rawsize, packed, globalOpts.lz_level);
+	double ratio = (rawsize ? 100.0*packedsize/rawsize : 100.0);
+
+	verbose ("-- Tile data: %lu bytes, %lu compressed (%.1f%%, %s parse)\n", (unsigned long)rawsize, (unsigned long)packedsize, ratio, (globalOpts.lz_level >= LZ_LEVEL_OPTIMAL ? "optimal" : "greedy"));
+
+	fprintf (f, "/* %s_%s[] is LZ compressed: %lu -> %lu bytes (%.1f%%). Decompress it with pngb_unlz(). */\n", globalOpts.name, suffix, (unsigned long)rawsize, (unsigned long)packedsize, ratio);
+	fprintf (gbdk_decl_file(f), "#define %s_%s_size\t%lu\n", globalOpts.name, suffix, (unsigned long)rawsize);
+	gbdk_data_array_output (suffix, packed, packedsize, 0, 0, f);
+	arena_free (packed);
+}
+
+/*** gbdk_tiles_output ******************************************************
+ * Outputs tiles 'first' to 'last'-1 as the name_suffix[] tile data array.  *
+ ****************************************************************************/
+void gbdk_tiles_output(PICDATA *gbpic, const char *suffix, int first, int last, FILE *f){
+	unsigned short rowword;
+	int t, y;
+
+	if (globalOpts.compress_tiles){
+		gbdk_compressed_tiles_output (gbpic, suffix, first, last, f);
+	}else if (globalOpts.rom_bank){
+		/* Tile data can be split between banks at any tile */
+		gbdk_data_array_output (suffix, &gbpic->tiles[first*gbpic->tileh*2], (last - first)*gbpic->tileh*2, gbpic->tileh*2, 0, f);
+	}else {
+		gbdk_decl_output (f, "const unsigned char %s_%s[]", globalOpts.name, suffix);
+		fputs (" = {\n", f);
+		for (t=first; t<last; t++){
+			fputs ("\t", f);
+			for (y=0;y<gbpic->tileh;y++){
+				rowword = get_tile_row(gbpic, t, y);
+				fprintf (f, "0x%02x, 0x%02x", (rowword>>8), (rowword & 0xff));
+				if (y < gbpic->tileh-1) fputs (", ", f);
+			}
+			fputs ((t<last-1? ",\n" : "\n};\n\n"), f);
+		}
+		/* Every tile was already in the -base-tiles set */
+		if (first == last) fputs ("\t0x00\n};\n\n", f);
+	}
+}
+
+/*** gbdk_compressed_rows_output ********************************************
+ * Outputs a cols x rows map (tile indexes or attributes) LZ compressing    *
+ * every row on its own, plus a table with the offset where each row        *
+ * starts. That way the game can decompress a single row when scrolling.    *
+ ****************************************************************************/
+void gbdk_compressed_rows_output(const char *suffix, BYTE *data, PICDATA *gbpic, FILE *f){
+	BYTE *packed = (BYTE *)arena_alloc(&jobArena, gbpic->rows*lz_bound(gbpic->cols));
+	unsigned int *offsets = (unsigned int *)arena_alloc(&jobArena, gbpic->rows*sizeof(unsigned int));
+	size_t packedsize = 0, rawsize = gbpic->cols*gbpic->rows;
+	int r;
+
+	for (r=0; r<gbpic->rows; r++){
+		offsets[r] = packedsize;
+		packedsize += lz_compress(&data[r*gbpic->cols], gbpic->cols, &packed[packedsize], globalOpts.lz_level);
+	}
+	if (packedsize > 0xffff) error ("ERROR: The compressed %s_%s[] is larger than 64KB!", globalOpts.name, suffix);
+	verbose ("-- %s_%s: %lu bytes, %lu compressed by rows (%.1f%%)\n", globalOpts.name, suffix, (unsigned long)rawsize, (unsigned long)packedsize, 100.0*packedsize/rawsize);
+
+	fprintf (f, "/* %s_%s[] is LZ compressed row by row: %lu -> %lu bytes. Row 'r' starts at %s_%s + %s_%s_rows[r]. */\n", globalOpts.name, suffix, (unsigned long)rawsize, (unsigned long)packedsize, globalOpts.name, suffix, globalOpts.name, suffix);
+	gbdk_data_array_output (suffix, packed, packedsize, 0, 0, f);
+
+	gbdk_decl_output (f, "const unsigned int %s_%s_rows[]", globalOpts.name, suffix);
+	fputs (" = {", f);
+	for (r=0; r<gbpic->rows; r++){
+		if (r % 8 == 0) fputs ("\n\t", f);
+		fprintf (f, "0x%04x", offsets[r]);
+		if (r < gbpic->rows-1) fputs (", ", f);
+	}
+	fputs ("\n};\n\n", f);
+
+	arena_free (offsets);
+	arena_free (packed);
+}
+
+/*** gbdk_vram_loader_output ************************************************
+ * Outputs a function that streams the tile data into VRAM in batches that  *
+ * fit in VBlank. On GBC it uses general purpose HDMA when the source is    *
+ * 16-byte aligned, otherwise it falls back to (budgeted) CPU copies.       *
+ * 'bank' 1 outputs name_load1(), for the tiles of GBC VRAM bank 1.         *
+ ****************************************************************************/
+void gbdk_vram_loader_output(PICDATA *gbpic, int bank, FILE *f){
+	char *n = globalOpts.name;
+	int sprites = (globalOpts.type == TARGET_SPRITE);
+	char func_name[8];
+	strcpy(func_name, (sprites ? "sprite" : (globalOpts.type == TARGET_BKG ? "bkg": "win")));
+
+	if (!bank){
+		fprintf (gbdk_decl_file(f), "#define %s_cpu_batch\t%d\n", n, globalOpts.vblank_tiles);
+		fprintf (gbdk_decl_file(f), "#define %s_dma_batch\t%d\n\n", n, VBLANK_DMA_TILES);
+		fprintf (f, "/* Loads the tiles from 'src' to VRAM, one batch per frame. GBC HDMA needs 'src' to be 16-byte aligned. */\n");
+		gbdk_decl_output (f, "void %s_load(const unsigned char *src)", n);
+	}else {
+		fprintf (f, "/* Same as %s_load(), for the %s_tiles1 tiles that go to VRAM bank 1. */\n", n, n);
+		gbdk_decl_output (f, "void %s_load1(const unsigned char *src)", n);
+	}
+	fputs (" {\n", f);
+	fprintf (f, "\tunsigned int left = %s_tiles%s;\n", n, (bank ? "1" : (is8x16Mode() ? "*2" : "")));
+	fprintf (f, "\tunsigned int dst;\n");
+	fprintf (f, "\tunsigned char idx = %s_%s;\n", n, (gbpic->base_tiles && !bank ? "first" : "base"));
+	fprintf (f, "\tunsigned char count, dma;\n\n");
+	if (bank) fprintf (f, "\tVBK_REG = 1;\n");
+	fprintf (f, "\twhile (left) {\n");
+	fprintf (f, "\t\tdma = (_cpu == CGB_TYPE && !((unsigned int)src & 0x0F));\n");
+	fprintf (f, "\t\tcount = (dma ? %s_dma_batch : %s_cpu_batch);\n", n, n);
+	fprintf (f, "\t\tif (count > left) count = left;\n");
+	if (!sprites){
+		/* In 8800 mode, tiles 0-127 live at 9000-97FF and 128-255 at 8800-8FFF,
+		so a single copy can't go past tile 127 */
+		fprintf (f, "\t\tif (!(LCDC_REG & 0x10) && idx < 128 && idx + count > 128) count = 128 - idx;\n");
+	}
+	fprintf (f, "\t\twait_vbl_done();\n");
+	fprintf (f, "\t\tif (dma) {\n");
+	if (sprites){
+		fprintf (f, "\t\t\tdst = 0x8000 + ((unsigned int)idx << 4);\n");
+	}else {
+		fprintf (f, "\t\t\tdst = ((LCDC_REG & 0x10) || idx >= 128 ? 0x8000 : 0x9000) + ((unsigned int)idx << 4);\n");
+	}
+	fprintf (f, "\t\t\tHDMA1_REG = (unsigned char)((unsigned int)src >> 8);\n");
+	fprintf (f, "\t\t\tHDMA2_REG = (unsigned char)((unsigned int)src);\n");
+	fprintf (f, "\t\t\tHDMA3_REG = (unsigned char)(dst >> 8);\n");
+	fprintf (f, "\t\t\tHDMA4_REG = (unsigned char)dst;\n");
+	fprintf (f, "\t\t\tHDMA5_REG = count - 1;\n");
+	fprintf (f, "\t\t} else {\n");
+	fprintf (f, "\t\t\tset_%s_data(idx, count, src);\n", func_name);
+	fprintf (f, "\t\t}\n");
+	fprintf (f, "\t\tsrc += (unsigned int)count << 4;\n");
+	fprintf (f, "\t\tidx += count;\n");
+	fprintf (f, "\t\tleft -= count;\n");
+	fprintf (f, "\t}\n");
+	if (bank) fprintf (f, "\tVBK_REG = 0;\n");
+	fprintf (f, "}\n\n");
+}
+
+/*** gbdk_map_columns_output ************************************************
+ * For maps larger than the 32x32 BG, outputs column-major copies of the    *
+ * map and attributes, so a column is contiguous just like a row is in the  *
+ * regular arrays.                                                          *
+ ****************************************************************************/
+void gbdk_map_columns_output(PICDATA *gbpic, FILE *f){
+	char *n = globalOpts.name;
+	int x, y, t = 0, total = gbpic->cols*gbpic->rows;
+
+	fprintf (f, "/* Column-major copies of %s_map[] and %s_att[]. Column 'c' starts at c*%s_rows. */\n", n, n, n);
+	if (globalOpts.rom_bank){
+		BYTE *colbytes = (BYTE *)arena_alloc(&jobArena, total*2);
+		for (x=0; x<gbpic->cols; x++){
+			for (y=0; y<gbpic->rows; y++, t++){
+				colbytes[t]			= gb_cell_tile(gbpic, y*gbpic->cols + x);
+				colbytes[total+t]	= gb_cell_attribute(gbpic, y*gbpic->cols + x);
+			}
+		}
+		gbdk_data_array_output ("map_cols", colbytes, total, gbpic->rows, 0, f);
+		gbdk_data_array_output ("att_cols", &colbytes[total], total, gbpic->rows, 0, f);
+		arena_free (colbytes);
+		return;
+	}
+	gbdk_decl_output (f, "const unsigned char %s_map_cols[]", n);
+	fputs (" = {", f);
+	for (x=0; x<gbpic->cols; x++){
+		for (y=0; y<gbpic->rows; y++, t++){
+			if (y == 0) fputs ("\n\t", f);
+			fprintf (f, "0x%02x", gb_cell_tile(gbpic, y*gbpic->cols + x));
+			if (t < total-1) fputs (", ", f);
+		}
+	}
+	fputs ("\n};\n\n", f);
+	gbdk_decl_output (f, "const unsigned char %s_att_cols[]", n);
+	fputs (" = {", f);
+	for (t=0, x=0; x<gbpic->cols; x++){
+		for (y=0; y<gbpic->rows; y++, t++){
+			if (y == 0) fputs ("\n\t", f);
+			fprintf (f, "0x%02x", gb_cell_attribute(gbpic, y*gbpic->cols + x));
+			if (t < total-1) fputs (", ", f);
+		}
+	}
+	fputs ("\n};\n\n", f);
+}
+
+/*** gbdk_map_streaming_output **********************************************
+ * Outputs the code that keeps the hardware BG up to date as a ring buffer  *
+ * for maps larger than 32x32, writing only the row/column the camera just  *
+ * exposed (see gbdk_map_columns_output).                                   *
+ ****************************************************************************/
+void gbdk_map_streaming_output(PICDATA *gbpic, FILE *f){
+	char *n = globalOpts.name;
+
+	/* The screen shows 20x18 tiles, 21x19 while scrolled between tiles */
+	fprintf (gbdk_decl_file(f), "#define %s_view_cols\t%d\n", n, MIN(gbpic->cols, 21));
+	fprintf (gbdk_decl_file(f), "#define %s_view_rows\t%d\n", n, MIN(gbpic->rows, 19));
+	fprintf (gbdk_decl_file(f), "#define %s_max_x\t%dU\n", n, (gbpic->w > 160 ? gbpic->w - 160 : 0));
+	fprintf (gbdk_decl_file(f), "#define %s_max_y\t%dU\n\n", n, (gbpic->h > 144 ? gbpic->h - 144 : 0));
+	gbdk_decl_output (f, "unsigned int %s_cam_x, %s_cam_y", n, n);
+	fputs (";\n\n", f);
+	if (gbpic->tile_slot) gbdk_tile_streaming_output (gbpic, f);
+
+	fprintf (f, "/* Writes the visible part of map row 'row' (starting at column 'col') into the BG ring buffer. */\n");
+	gbdk_decl_output (f, "void %s_stream_row(unsigned int col, unsigned int row)", n);
+	fputs (" {\n", f);
+	fprintf (f, "\tunsigned char x = col & 31, y = row & 31, w = %s_view_cols, first;\n", n);
+	fprintf (f, "\tunsigned int ofs;\n\n");
+	fprintf (f, "\tif (row >= %s_rows || col >= %s_cols) return;\n", n, n);
+	fprintf (f, "\tif (col + w > %s_cols) w = %s_cols - col;\n", n, n);
+	fprintf (f, "\tofs = row * %s_cols + col;\n", n);
+	fprintf (f, "\tfirst = (x + w > 32 ? 32 - x : w);\n");
+	fprintf (f, "\tVBK_REG = 1;\n");
+	gbdk_bank_switch_output ("att", "\t", f);
+	fprintf (f, "\tset_bkg_tiles(x, y, first, 1, %s_att + ofs);\n", n);
+	fprintf (f, "\tif (first < w) set_bkg_tiles(0, y, w - first, 1, %s_att + ofs + first);\n", n);
+	fprintf (f, "\tVBK_REG = 0;\n");
+	gbdk_bank_switch_output ("map", "\t", f);
+	fprintf (f, "\tset_bkg_tiles(x, y, first, 1, %s_map + ofs);\n", n);
+	fprintf (f, "\tif (first < w) set_bkg_tiles(0, y, w - first, 1, %s_map + ofs + first);\n", n);
+	fprintf (f, "}\n\n");
+
+	fprintf (f, "/* Writes the visible part of map column 'col' (starting at row 'row') into the BG ring buffer. */\n");
+	gbdk_decl_output (f, "void %s_stream_col(unsigned int col, unsigned int row)", n);
+	fputs (" {\n", f);
+	fprintf (f, "\tunsigned char x = col & 31, y = row & 31, h = %s_view_rows, first;\n", n);
+	fprintf (f, "\tunsigned int ofs;\n\n");
+	fprintf (f, "\tif (row >= %s_rows || col >= %s_cols) return;\n", n, n);
+	fprintf (f, "\tif (row + h > %s_rows) h = %s_rows - row;\n", n, n);
+	fprintf (f, "\tofs = col * %s_rows + row;\n", n);
+	fprintf (f, "\tfirst = (y + h > 32 ? 32 - y : h);\n");
+	fprintf (f, "\tVBK_REG = 1;\n");
+	gbdk_bank_switch_output ("att_cols", "\t", f);
+	fprintf (f, "\tset_bkg_tiles(x, y, 1, first, %s_att_cols + ofs);\n", n);
+	fprintf (f, "\tif (first < h) set_bkg_tiles(x, 0, 1, h - first, %s_att_cols + ofs + first);\n", n);
+	fprintf (f, "\tVBK_REG = 0;\n");
+	gbdk_bank_switch_output ("map_cols", "\t", f);
+	fprintf (f, "\tset_bkg_tiles(x, y, 1, first, %s_map_cols + ofs);\n", n);
+	fprintf (f, "\tif (first < h) set_bkg_tiles(x, 0, 1, h - first, %s_map_cols + ofs + first);\n", n);
+	fprintf (f, "}\n\n");
+
+	fprintf (f, "/* Draws the whole screen at camera position (x, y), in pixels. */\n");
+	gbdk_decl_output (f, "void %s_stream_init(unsigned int x, unsigned int y)", n);
+	fputs (" {\n", f);
+	fprintf (f, "\tunsigned char r;\n\n");
+	fprintf (f, "\t%s_cam_x = x;\n", n);
+	fprintf (f, "\t%s_cam_y = y;\n", n);
+	fprintf (f, "\tfor (r = 0; r < %s_view_rows; r++) %s_stream_row(x >> 3, (y >> 3) + r);\n", n, n);
+	fprintf (f, "\tmove_bkg((unsigned char)x, (unsigned char)y);\n");
+	fprintf (f, "}\n\n");
+
+	fprintf (f, "/* Moves the camera to (x, y), streaming in only the rows and columns that became visible. */\n");
+	gbdk_decl_output (f, "void %s_scroll_to(unsigned int x, unsigned int y)", n);
+	fputs (" {\n", f);
+	fprintf (f, "\tunsigned int oc = %s_cam_x >> 3, nc = x >> 3;\n", n);
+	fprintf (f, "\tunsigned int orow = %s_cam_y >> 3, nrow = y >> 3;\n\n", n);
+	if (gbpic->tile_slot){
+		/* Queue the tiles the camera is getting close to, before it shows them */
+		fprintf (f, "\tif (nc > oc) %s_prefetch((int)oc + %s_view_cols + %s_stream_margin, (int)nrow - %s_stream_margin, nc - oc, %s_view_rows + 2*%s_stream_margin);\n", n, n, n, n, n, n);
+		fprintf (f, "\tif (nc < oc) %s_prefetch((int)nc - %s_stream_margin, (int)nrow - %s_stream_margin, oc - nc, %s_view_rows + 2*%s_stream_margin);\n", n, n, n, n, n);
+		fprintf (f, "\tif (nrow > orow) %s_prefetch((int)nc - %s_stream_margin, (int)orow + %s_view_rows + %s_stream_margin, %s_view_cols + 2*%s_stream_margin, nrow - orow);\n", n, n, n, n, n, n);
+		fprintf (f, "\tif (nrow < orow) %s_prefetch((int)nc - %s_stream_margin, (int)nrow - %s_stream_margin, %s_view_cols + 2*%s_stream_margin, orow - nrow);\n", n, n, n, n, n);
+	}
+	fprintf (f, "\twhile (oc < nc) { oc++; %s_stream_col(oc + %s_view_cols - 1, nrow); }\n", n, n);
+	fprintf (f, "\twhile (oc > nc) { oc--; %s_stream_col(oc, nrow); }\n", n);
+	fprintf (f, "\twhile (orow < nrow) { orow++; %s_stream_row(nc, orow + %s_view_rows - 1); }\n", n, n);
+	fprintf (f, "\twhile (orow > nrow) { orow--; %s_stream_row(nc, orow); }\n", n);
+	fprintf (f, "\t%s_cam_x = x;\n", n);
+	fprintf (f, "\t%s_cam_y = y;\n", n);
+	fprintf (f, "\tmove_bkg((unsigned char)x, (unsigned char)y);\n");
+	fprintf (f, "}\n\n");
+}
+
+/*** gbdk_metasprite_output *************************************************
+ * Outputs the metasprite table (one dx, dy, tile, attribute entry for each *
+ * non-empty sprite) and routines to show and move it. Animation sheets get *
+ * one run of entries per frame.                                            *
+ ****************************************************************************/
+void gbdk_metasprite_output(PICDATA *gbpic, FILE *f){
+	char *n = globalOpts.name;
+	unsigned int t;
+	int x, y, fr, sprites, i = 0, count = 0, maxcount = 0;
+	int frame_rows = gbpic->rows/gbpic->frames;
+	int tstep = (is8x16Mode() ? 2 : 1);
+
+	for (fr=0; fr<gbpic->frames; fr++){
+		sprites = count_meta_sprites(gbpic, fr);
+		count += sprites;
+		if (sprites > maxcount) maxcount = sprites;
+	}
+	verbose ("-- Metasprite: %d hardware sprites (%d without dropping empty tiles)\n", count, gbpic->cols*gbpic->rows);
+	if (globalOpts.frame_w){
+		fprintf (gbdk_decl_file(f), "#define %s_meta_max\t%d\n\n", n, maxcount);
+	}else {
+		fprintf (gbdk_decl_file(f), "#define %s_meta_count\t%d\n\n", n, count);
+	}
+	fprintf (f, "/* One entry per hardware sprite: dx, dy, tile, attributes. */\n");
+	gbdk_decl_output (f, "const unsigned char %s_meta[]", n);
+	fputs (" = {", f);
+	for (y=0; y<gbpic->rows; y++){
+		for (x=0; x<gbpic->cols; x++){
+			t = gbpic->tilemap[y*gbpic->cols + x];
+			if (t == TILE_EMPTY) continue;
+			fprintf (f, "\n\t%d, %d, 0x%02x, 0x%02x", x*8, (y % frame_rows)*gbpic->tileh, (BYTE)(globalOpts.baseindex + t*tstep), gb_cell_attribute(gbpic, t));
+			if (++i < count) fputs (",", f);
+		}
+	}
+	fputs ("\n};\n\n", f);
+
+	if (globalOpts.frame_w){
+		fprintf (f, "/* Frame 'f' uses entries %s_meta_frame[f] to %s_meta_frame[f+1]-1. */\n", n, n);
+		gbdk_decl_output (f, "const unsigned int %s_meta_frame[]", n);
+		fputs (" = {", f);
+		for (i=0, fr=0; fr<=gbpic->frames; fr++){
+			if (fr % 16 == 0) fputs ("\n\t", f);
+			fprintf (f, "%d", i);
+			if (fr < gbpic->frames){
+				i += count_meta_sprites(gbpic, fr);
+				fputs (", ", f);
+			}
+		}
+		fputs ("\n};\n\n", f);
+
+		fprintf (f, "/* Sets the tiles and attributes of a frame starting at hardware sprite 'first',\n");
+		fprintf (f, "hiding the sprites a bigger frame may have left behind. Returns the sprite count. */\n");
+		gbdk_decl_output (f, "unsigned char %s_show(unsigned char first, unsigned char frame)", n);
+		fputs (" {\n", f);
+		fprintf (f, "\tunsigned char i, count = %s_meta_frame[frame + 1] - %s_meta_frame[frame];\n", n, n);
+		fprintf (f, "\tconst unsigned char *m = %s_meta + %s_meta_frame[frame] * 4;\n\n", n, n);
+		fprintf (f, "\tfor (i = 0; i < count; i++, m += 4) {\n");
+		fprintf (f, "\t\tset_sprite_tile(first + i, m[2]);\n");
+		fprintf (f, "\t\tset_sprite_prop(first + i, m[3]);\n");
+		fprintf (f, "\t}\n");
+		fprintf (f, "\tfor (; i < %s_meta_max; i++) move_sprite(first + i, 0, 0);\n", n);
+		fprintf (f, "\treturn count;\n");
+		fprintf (f, "}\n\n");
+
+		fprintf (f, "/* Moves a frame shown at 'first' to (x, y). */\n");
+		gbdk_decl_output (f, "void %s_move(unsigned char first, unsigned char frame, unsigned char x, unsigned char y)", n);
+		fputs (" {\n", f);
+		fprintf (f, "\tunsigned char i, count = %s_meta_frame[frame + 1] - %s_meta_frame[frame];\n", n, n);
+		fprintf (f, "\tconst unsigned char *m = %s_meta + %s_meta_frame[frame] * 4;\n\n", n, n);
+		fprintf (f, "\tfor (i = 0; i < count; i++, m += 4) move_sprite(first + i, x + m[0], y + m[1]);\n");
+		fprintf (f, "}\n\n");
+		return;
+	}
+
+	fprintf (f, "/* Sets the tiles and attributes of hardware sprites 'first' to 'first'+%s_meta_count-1. */\n", n);
+	gbdk_decl_output (f, "void %s_show(unsigned char first)", n);
+	fputs (" {\n", f);
+	fprintf (f, "\tunsigned char i;\n");
+	fprintf (f, "\tconst unsigned char *m = %s_meta;\n\n", n);
+	fprintf (f, "\tfor (i = 0; i < %s_meta_count; i++, m += 4) {\n", n);
+	fprintf (f, "\t\tset_sprite_tile(first + i, m[2]);\n");
+	fprintf (f, "\t\tset_sprite_prop(first + i, m[3]);\n");
+	fprintf (f, "\t}\n");
+	fprintf (f, "}\n\n");
+
+	/* Moving happens every frame, so this one gets unrolled */
+	fprintf (f, "/* Moves the metasprite shown at 'first' to (x, y). */\n");
+	gbdk_decl_output (f, "void %s_move(unsigned char first, unsigned char x, unsigned char y)", n);
+	fputs (" {\n", f);
+	for (i=0, y=0; y<gbpic->rows; y++){
+		for (x=0; x<gbpic->cols; x++){
+			if (gbpic->tilemap[y*gbpic->cols + x] == TILE_EMPTY) continue;
+			fprintf (f, "\tmove_sprite(first + %d, x + %dU, y + %dU);\n", i++, x*8, y*gbpic->tileh);
+		}
+	}
+	fprintf (f, "}\n\n");
+}
+
 /*** gbdk_c_code_output *****************************************************
  * Outputs the GB Picture and palette data according to the selected        *
- * options, in GBDK-compatible C Code.                                      *
+ * options, in GBDK-compatible C Code. If 'h' is given, the defines and     *
+ * declarations go there instead, and 'f' includes it as 'hname'.           *
  ****************************************************************************/
-void gbdk_c_code_output(PICDATA *gbpic, FILE *f){
-	int x, y, t;
-	unsigned short rowword;
+void gbdk_c_code_output(PICDATA *gbpic, FILE *f, FILE *h, const char *hname){
+	int t;
 	int tdat = gbpic->cols*gbpic->rows;
 	int tattr = (globalOpts.type == TARGET_SPRITE ? gbpic->total_tiles : tdat);
+	int spritegroup = 0;
 	verbose ("\n<GENERATING CODE>\n");
 
 	sanitize_var_name(globalOpts.name, strlen(globalOpts.name));
 	/* ~~~~~~~~~~~~~~ STEP 1 (PRELUDE) ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 	if (globalOpts.test_code) fprintf (f, "#include <gb/gb.h>\n\n");
+	if (h){
+		/* Split output: defines and declarations go to the header (see gbdk_decl_file) */
+		declFile = h;
+		fprintf (h, "#ifndef __PNGB_%s_H\n#define __PNGB_%s_H\n\n", globalOpts.name, globalOpts.name);
+		fprintf (f, "#include \"%s\"\n\n", hname);
+	}
 
-	fprintf (f, "#define %s_cols\t%d\n", globalOpts.name, gbpic->cols);
-	fprintf (f, "#define %s_rows\t%d\n", globalOpts.name, gbpic->rows);
-	fprintf (f, "#define %s_base\t%d\n", globalOpts.name, globalOpts.baseindex);
-	fprintf (f, "#define %s_tsize\t%s_cols*%s_rows\n", globalOpts.name, globalOpts.name, globalOpts.name);
-	fprintf (f, "#define %s_tiles\t%d\n\n", globalOpts.name, gbpic->total_tiles);
+	fprintf (gbdk_decl_file(f), "#define %s_cols\t%d\n", globalOpts.name, gbpic->cols);
+	fprintf (gbdk_decl_file(f), "#define %s_rows\t%d\n", globalOpts.name, gbpic->rows/gbpic->frames);
+	if (globalOpts.frame_w) fprintf (gbdk_decl_file(f), "#define %s_frames\t%d\n", globalOpts.name, gbpic->frames);
+	fprintf (gbdk_decl_file(f), "#define %s_base\t%d\n", globalOpts.name, globalOpts.baseindex);
+	/* Tiles from -base-tiles are already in VRAM; %s_dat[] only holds the rest */
+	if (gbpic->base_tiles) fprintf (gbdk_decl_file(f), "#define %s_first\t%d\n", globalOpts.name, first_data_tile(gbpic));
+	fprintf (gbdk_decl_file(f), "#define %s_tsize\t%s_cols*%s_rows\n", globalOpts.name, globalOpts.name, globalOpts.name);
+	fprintf (gbdk_decl_file(f), "#define %s_tiles\t%d\n", globalOpts.name, gbpic->total_tiles - gbpic->base_tiles - gbpic->bank1_tiles);
+	if (gbpic->bank1_tiles) fprintf (gbdk_decl_file(f), "#define %s_tiles1\t%d\n", globalOpts.name, gbpic->bank1_tiles);
+	fputs ("\n", gbdk_decl_file(f));
 
 	/* ~~~~~~~~~~~~~~ STEP 2 (PALETTE) ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 	if (globalOpts.create_palette){
 		int c;
-		fprintf (f, "const unsigned int %s_pal[] = {", globalOpts.name);
+		gbdk_decl_output (f, "const unsigned int %s_pal[]", globalOpts.name);
+		fputs (" = {", f);
 		for (c=0; c<4; c++){
 			fprintf (f, " 0x%04x%c", (unsigned short)gbpic->pal[c], (c<3? ',' : ' '));
 		}
@@ -668,41 +2057,104 @@ void gbdk_c_code_output(PICDATA *gbpic, FILE *f){
 	}
 
 	/* ~~~~~~~~~~~~~~ STEP 3 (TILES) ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
-	fprintf (f, "const unsigned char %s_dat[] = {\n", globalOpts.name);
-	for (t=0; t<gbpic->total_tiles; t++){
-		fputs ("\t", f);
-		for (y=0;y<gbpic->tileh;y++){
-			rowword = get_tile_row(gbpic, t, y);
-			fprintf (f, "0x%02x, 0x%02x", (rowword>>8), (rowword & 0xff));
-			if (y < gbpic->tileh-1) fputs (", ", f);
-		}
-		fputs ((t<gbpic->total_tiles-1? ",\n" : "\n};\n\n"), f);
-	}
+	/* Tiles for GBC VRAM bank 1 get their own array, loaded separately */
+	gbdk_tiles_output (gbpic, "dat", gbpic->base_tiles, gbpic->total_tiles - gbpic->bank1_tiles, f);
+	if (gbpic->bank1_tiles) gbdk_tiles_output (gbpic, "dat1", gbpic->total_tiles - gbpic->bank1_tiles, gbpic->total_tiles, f);
 	/* ~~~~~~~~~~~~~~ STEP 3 (TILE/SPRITE ATTRIBUTES) ~~~~~~~~~~~~~~~~~~~~~~*/
 	/*	For the most of it, the "attributes" are the palette, which is the
 		lowest 3 bits for both sprites and BG/WIN tiles. */
-	fprintf (f, "const unsigned char %s_att[] = {", globalOpts.name);
-	for (t=0; t < tattr; t++){
-		if (t % gbpic->cols == 0) fputs("\n\t", f);
-		fprintf (f, "0x%02x", globalOpts.palnumber);
-		if (t < tattr-1) fputs (", ", f);
+	if (globalOpts.compress_map){
+		BYTE *attbytes = (BYTE *)arena_alloc(&jobArena, tattr);
+		for (t=0; t < tattr; t++) attbytes[t] = gb_cell_attribute(gbpic, t);
+		gbdk_compressed_rows_output ("att", attbytes, gbpic, f);
+		arena_free (attbytes);
+	}else if (globalOpts.rom_bank){
+		/* Sprite maps and attributes are small and read together, so they share a bank */
+		if (globalOpts.type == TARGET_SPRITE) spritegroup = bank_new_group();
+		BYTE *attbytes = (BYTE *)arena_alloc(&jobArena, tattr);
+		for (t=0; t < tattr; t++) attbytes[t] = gb_cell_attribute(gbpic, t);
+		gbdk_data_array_output ("att", attbytes, tattr, gbpic->cols, spritegroup, f);
+		arena_free (attbytes);
+	}else {
+		gbdk_decl_output (f, "const unsigned char %s_att[]", globalOpts.name);
+		fputs (" = {", f);
+		for (t=0; t < tattr; t++){
+			if (t % gbpic->cols == 0) fputs("\n\t", f);
+			fprintf (f, "0x%02x", gb_cell_attribute(gbpic, t));
+			if (t < tattr-1) fputs (", ", f);
+		}
+		fputs("\n};\n\n", f);
 	}
-	fputs("\n};\n\n", f);
 
 	/* ~~~~~~~~~~~~~~ STEP 4 (TILE/SPRITE MAP) ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
-	if (globalOpts.create_map){
-		fprintf (f, "const unsigned char %s_map[] = {", globalOpts.name);
+	if (globalOpts.metasprite){
+		/* Empty cells have no tile, so the metasprite table replaces the map */
+		gbdk_metasprite_output (gbpic, f);
+	}else if (globalOpts.create_map && globalOpts.compress_map){
+		BYTE *mapbytes = (BYTE *)arena_alloc(&jobArena, tdat);
+		for (t=0; t < tdat; t++) mapbytes[t] = gb_cell_tile(gbpic, t);
+		gbdk_compressed_rows_output ("map", mapbytes, gbpic, f);
+		arena_free (mapbytes);
+	}else if (globalOpts.create_map && globalOpts.rom_bank){
+		BYTE *mapbytes = (BYTE *)arena_alloc(&jobArena, tdat);
+		for (t=0; t < tdat; t++) mapbytes[t] = gb_cell_tile(gbpic, t);
+		gbdk_data_array_output ("map", mapbytes, tdat, gbpic->cols, spritegroup, f);
+		arena_free (mapbytes);
+	}else if (globalOpts.create_map){
+		gbdk_decl_output (f, "const unsigned char %s_map[]", globalOpts.name);
+		fputs (" = {", f);
 		for (t=0; t < tdat; t++){
 			if (t % gbpic->cols == 0) fputs("\n\t", f);
-			fprintf (f, "0x%02x", globalOpts.baseindex+(gbpic->tilemap[t]));
+			fprintf (f, "0x%02x", gb_cell_tile(gbpic, t));
 			if (t < tdat-1) fputs (", ", f);
 		}
 		fputs("\n};\n\n", f);
 	}
 
+	/* ~~~~~~~~~~~~~~ STEP 4 (LARGE MAP STREAMING) ~~~~~~~~~~~~~~~~~~~~~~~~~*/
+	if (globalOpts.large_map) gbdk_map_columns_output (gbpic, f);
+	if (gbpic->tile_slot) gbdk_stream_tables_output (gbpic, f);
+
+	/* ~~~~~~~~~~~~~~ STEP 4 (ROM BANKS) ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+	/* Everything that was sent to the bank files is in by now */
+	if (globalOpts.rom_bank && bank_shared()){
+		/* The banks of every job of the run are packed after the last one */
+		fprintf (gbdk_decl_file(f), "#include \"%s.h\"\n\n", BANK_SHARED_NAME);
+	}else if (globalOpts.rom_bank){
+		verbose ("\n<PACKING ROM BANKS>\n");
+		bank_pack (globalOpts.rom_bank);
+		gbdk_bank_index_output (globalOpts.name, f);
+	}
+
+	if (globalOpts.large_map) gbdk_map_streaming_output (gbpic, f);
+
+	/* ~~~~~~~~~~~~~~ STEP 4 (VRAM LOADER) ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+	if (globalOpts.vram_loader){
+		gbdk_vram_loader_output (gbpic, 0, f);
+		if (gbpic->bank1_tiles) gbdk_vram_loader_output (gbpic, 1, f);
+	}
+
 	/* ~~~~~~~~~~~~~~ STEP 5 (SAMPLE CODE) ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 	if (globalOpts.test_code){
-		if (globalOpts.type == TARGET_SPRITE){
+		/* Compressed tiles have to be unpacked to RAM before loading them */
+		char dat_src[280];
+		snprintf (dat_src, sizeof(dat_src), "%s_%s", globalOpts.name, (globalOpts.compress_tiles ? "buf" : "dat"));
+		if (globalOpts.compress_tiles || globalOpts.compress_map) gbdk_lz_decoder_output (f);
+		/* Both VRAM banks are unpacked to the same buffer, one after the other */
+		char buf_size[600];
+		if (gbpic->bank1_tiles) snprintf (buf_size, sizeof(buf_size), "(%s_dat_size > %s_dat1_size ? %s_dat_size : %s_dat1_size)", globalOpts.name, globalOpts.name, globalOpts.name, globalOpts.name);
+		else snprintf (buf_size, sizeof(buf_size), "%s_dat_size", globalOpts.name);
+		if (globalOpts.compress_tiles && globalOpts.vram_loader){
+			/* Give HDMA a 16-byte aligned buffer to copy from */
+			fprintf (f, "\nunsigned char %s_buf[%s + 15];\n", globalOpts.name, buf_size);
+			fprintf (f, "#define %s_abuf\t((unsigned char *)(((unsigned int)%s_buf + 15) & 0xFFF0))\n", globalOpts.name, globalOpts.name);
+			snprintf (dat_src, sizeof(dat_src), "%s_abuf", globalOpts.name);
+		}else if (globalOpts.compress_tiles){
+			fprintf (f, "\nunsigned char %s_buf[%s];\n", globalOpts.name, buf_size);
+		}
+		if (globalOpts.compress_map) fprintf (f, "\nunsigned char %s_row[%s_cols];\n", globalOpts.name, globalOpts.name);
+
+		if (globalOpts.type == TARGET_SPRITE && !globalOpts.metasprite){
 			/* Aux function for sprites */
 			fprintf (f, "\n/* This function sets a sprite tile, attributes (palette) and position. It's just for demo purposes, this is NOT efficient at ALL! */\n");
 			fprintf (f, "void set_%s_sprite(unsigned char index, unsigned char tile, unsigned char attr, unsigned char x, unsigned char y) {\n", globalOpts.name);
@@ -719,42 +2171,143 @@ void gbdk_c_code_output(PICDATA *gbpic, FILE *f){
 			int dx = (globalOpts.type == TARGET_BKG ? -(160-gbpic->w)/2 : (160-gbpic->w)/2 + 7);
 			int dy = (globalOpts.type == TARGET_BKG ? -(144-gbpic->h)/2 : (144-gbpic->h)/2 );
 			strcpy(func_name, (globalOpts.type == TARGET_BKG ? "bkg": "win"));
+			if (globalOpts.compress_map) fprintf (f, "\tunsigned char y;\n\n");
+			if (globalOpts.large_map) fprintf (f, "\tunsigned int x = 0, y = 0;\n\tunsigned char keys;\n\n");
+			if (globalOpts.frame_w && !globalOpts.compress_map) fprintf (f, "\tunsigned char i, frame = 0;\n\n");
+			gbdk_bank_switch_output ("dat", "\t", f);
+			if (globalOpts.compress_tiles) fprintf (f, "\tpngb_unlz(%s, %s_dat);\n", dat_src, globalOpts.name);
 			if (globalOpts.create_palette){
 				fprintf (f, "\tset_bkg_palette(%d, 1, %s_pal);\n", globalOpts.palnumber, globalOpts.name);
 			}
-			fprintf (f, "\tset_%s_data(0x%02x, %s_tiles, %s_dat);\n", func_name, globalOpts.baseindex, globalOpts.name, globalOpts.name);
-			fprintf (f, "\tVBK_REG = 1;\n");
-			fprintf (f, "\tset_%s_tiles(0, 0, %s_cols, %s_rows, %s_att);\n", func_name, globalOpts.name, globalOpts.name, globalOpts.name);
-			fprintf (f, "\tVBK_REG = 0;\n");
-			fprintf (f, "\tset_%s_tiles(0, 0, %s_cols, %s_rows, %s_map);\n", func_name, globalOpts.name, globalOpts.name, globalOpts.name);
-			fprintf (f, "\tmove_%s (%d, %d);\n", func_name, dx, dy);
+			if (gbpic->tile_slot){
+				/* Only the tiles around the camera are loaded */
+				fprintf (f, "\t%s_stream_tiles_init(0, 0);\n", globalOpts.name);
+			}else if (globalOpts.vram_loader){
+				fprintf (f, "\tVBK_REG = 0;\n");
+				fprintf (f, "\t%s_load(%s);\n", globalOpts.name, dat_src);
+			}else {
+				fprintf (f, "\tset_%s_data(0x%02x, %s_tiles, %s);\n", func_name, first_data_tile(gbpic), globalOpts.name, dat_src);
+			}
+			if (gbpic->bank1_tiles){
+				/* Compressed tiles reuse the buffer bank 0 was unpacked to */
+				char dat1_src[280];
+				if (globalOpts.compress_tiles) snprintf (dat1_src, sizeof(dat1_src), "%s", dat_src);
+				else snprintf (dat1_src, sizeof(dat1_src), "%s_dat1", globalOpts.name);
+				gbdk_bank_switch_output ("dat1", "\t", f);
+				if (globalOpts.compress_tiles) fprintf (f, "\tpngb_unlz(%s, %s_dat1);\n", dat1_src, globalOpts.name);
+				if (globalOpts.vram_loader){
+					fprintf (f, "\t%s_load1(%s);\n", globalOpts.name, dat1_src);
+				}else {
+					fprintf (f, "\tVBK_REG = 1;\n");
+					fprintf (f, "\tset_%s_data(0x%02x, %s_tiles1, %s);\n", func_name, globalOpts.baseindex, globalOpts.name, dat1_src);
+					fprintf (f, "\tVBK_REG = 0;\n");
+				}
+			}
+			if (globalOpts.compress_map){
+				/* Every row of the map can be decompressed on its own */
+				fprintf (f, "\tfor (y = 0; y < %s_rows; y++) {\n", globalOpts.name);
+				fprintf (f, "\t\tVBK_REG = 1;\n");
+				gbdk_bank_switch_output ("att", "\t\t", f);
+				fprintf (f, "\t\tpngb_unlz(%s_row, %s_att + %s_att_rows[y]);\n", globalOpts.name, globalOpts.name, globalOpts.name);
+				fprintf (f, "\t\tset_%s_tiles(0, y, %s_cols, 1, %s_row);\n", func_name, globalOpts.name, globalOpts.name);
+				fprintf (f, "\t\tVBK_REG = 0;\n");
+				gbdk_bank_switch_output ("map", "\t\t", f);
+				fprintf (f, "\t\tpngb_unlz(%s_row, %s_map + %s_map_rows[y]);\n", globalOpts.name, globalOpts.name, globalOpts.name);
+				fprintf (f, "\t\tset_%s_tiles(0, y, %s_cols, 1, %s_row);\n", func_name, globalOpts.name, globalOpts.name);
+				fprintf (f, "\t}\n");
+			}else if (globalOpts.large_map){
+				fprintf (f, "\t%s_stream_init(0, 0);\n", globalOpts.name);
+			}else {
+				fprintf (f, "\tVBK_REG = 1;\n");
+				gbdk_bank_switch_output ("att", "\t", f);
+				fprintf (f, "\tset_%s_tiles(0, 0, %s_cols, %s_rows, %s_att);\n", func_name, globalOpts.name, globalOpts.name, globalOpts.name);
+				fprintf (f, "\tVBK_REG = 0;\n");
+				gbdk_bank_switch_output ("map", "\t", f);
+				fprintf (f, "\tset_%s_tiles(0, 0, %s_cols, %s_rows, %s_map);\n", func_name, globalOpts.name, globalOpts.name, globalOpts.name);
+			}
+			if (!globalOpts.large_map) fprintf (f, "\tmove_%s (%d, %d);\n", func_name, dx, dy);
 			fprintf (f, "\n\tSHOW_%s;\n", (globalOpts.type == TARGET_BKG ? "BKG" : "WIN"));
 		}else{
 			int dx = (160-gbpic->w)/2 + 8;
 			int dy = (144-gbpic->h)/2 + 16;
-			fprintf (f, "\tunsigned char x, y, xt, yt, i=0;\n");
+			if (!globalOpts.metasprite) fprintf (f, "\tunsigned char x, y, xt, yt, i=0;\n");
+			else if (globalOpts.frame_w) fprintf (f, "\tunsigned char i, frame = 0;\n\n");
+			gbdk_bank_switch_output ("dat", "\t", f);
+			if (globalOpts.compress_tiles) fprintf (f, "\tpngb_unlz(%s, %s_dat);\n", dat_src, globalOpts.name);
 			if (globalOpts.big_sprite) fprintf (f, "\tSPRITES_8x16;\n");
 			if (globalOpts.create_palette){
 				fprintf (f, "\tset_sprite_palette(%d, 1, %s_pal);\n", globalOpts.palnumber, globalOpts.name);
 			}
-			fprintf (f, "\tset_sprite_data(0x%02x, %s_tiles%s, %s_dat);\n", globalOpts.baseindex, globalOpts.name, (globalOpts.big_sprite? "*2" : ""), globalOpts.name);
-			fprintf (f, "\tVBK_REG = 0;\n\n");
-			fprintf (f, "\tfor(y=0; y< %s_rows; y++){\n", globalOpts.name);
-			fprintf (f, "\t\tyt=y*%dU;\n", gbpic->tileh);
-			fprintf (f, "\t\tfor(x=0; x < %s_cols; x++){\n", globalOpts.name);
-			fprintf (f, "\t\t\txt=x*8;\n");
-			fprintf (f, "\t\t\tif (i >= %s_tsize) break;\n", globalOpts.name);
-			fprintf (f, "\t\t\tset_%s_sprite (i, %s_map[i]%s, %s_att[%s_map[i]-%s_base], xt+%dU, yt+%dU);\n", globalOpts.name, globalOpts.name, (is8x16Mode() ? "*2" : ""), globalOpts.name, globalOpts.name, globalOpts.name, dx, dy);
-			fprintf (f, "\t\t\ti++;\n");
-			fprintf (f, "\t\t}\n", globalOpts.name);
-			fprintf (f, "\t}\n", globalOpts.name);
+			if (globalOpts.vram_loader){
+				fprintf (f, "\tVBK_REG = 0;\n");
+				fprintf (f, "\t%s_load(%s);\n\n", globalOpts.name, dat_src);
+			}else {
+				fprintf (f, "\tset_sprite_data(0x%02x, %s_tiles%s, %s);\n", first_data_tile(gbpic), globalOpts.name, (globalOpts.big_sprite? "*2" : ""), dat_src);
+				fprintf (f, "\tVBK_REG = 0;\n\n");
+			}
+			if (globalOpts.metasprite && globalOpts.frame_w){
+				fprintf (f, "\t%s_show(0, 0);\n", globalOpts.name);
+				fprintf (f, "\t%s_move(0, 0, %dU, %dU);\n", globalOpts.name, dx, dy);
+			}else if (globalOpts.metasprite){
+				fprintf (f, "\t%s_show(0);\n", globalOpts.name);
+				fprintf (f, "\t%s_move(0, %dU, %dU);\n", globalOpts.name, dx, dy);
+			}else {
+				gbdk_bank_switch_output ("map", "\t", f);
+				fprintf (f, "\tfor(y=0; y< %s_rows; y++){\n", globalOpts.name);
+				fprintf (f, "\t\tyt=y*%dU;\n", gbpic->tileh);
+				fprintf (f, "\t\tfor(x=0; x < %s_cols; x++){\n", globalOpts.name);
+				fprintf (f, "\t\t\txt=x*8;\n");
+				fprintf (f, "\t\t\tif (i >= %s_tsize) break;\n", globalOpts.name);
+				fprintf (f, "\t\t\tset_%s_sprite (i, %s_map[i]%s, %s_att[%s_map[i]-%s_base], xt+%dU, yt+%dU);\n", globalOpts.name, globalOpts.name, (is8x16Mode() ? "*2" : ""), globalOpts.name, globalOpts.name, globalOpts.name, dx, dy);
+				fprintf (f, "\t\t\ti++;\n");
+				fprintf (f, "\t\t}\n", globalOpts.name);
+				fprintf (f, "\t}\n", globalOpts.name);
+			}
 			fprintf (f, "\n\tSHOW_SPRITES;\n");
 		}
 
 		fprintf (f, "\tenable_interrupts();\n");
 		fprintf (f, "\tDISPLAY_ON;\n");
+		if (globalOpts.large_map){
+			/* Let the user walk around the map with the joypad */
+			fprintf (f, "\n\twhile (1) {\n");
+			fprintf (f, "\t\tkeys = joypad();\n");
+			fprintf (f, "\t\tif ((keys & J_RIGHT) && x < %s_max_x) x++;\n", globalOpts.name);
+			fprintf (f, "\t\tif ((keys & J_LEFT) && x > 0) x--;\n");
+			fprintf (f, "\t\tif ((keys & J_DOWN) && y < %s_max_y) y++;\n", globalOpts.name);
+			fprintf (f, "\t\tif ((keys & J_UP) && y > 0) y--;\n");
+			fprintf (f, "\t\twait_vbl_done();\n");
+			if (gbpic->tile_slot) fprintf (f, "\t\t%s_stream_tiles();\n", globalOpts.name);
+			fprintf (f, "\t\t%s_scroll_to(x, y);\n", globalOpts.name);
+			fprintf (f, "\t}\n");
+		}else if (globalOpts.frame_w && globalOpts.type != TARGET_SPRITE && !globalOpts.compress_map){
+			/* Play the animation, one frame every 8 VBlanks */
+			char func_name[4];
+			strcpy(func_name, (globalOpts.type == TARGET_BKG ? "bkg": "win"));
+			fprintf (f, "\n\twhile (1) {\n");
+			fprintf (f, "\t\tfor (i = 0; i < 8; i++) wait_vbl_done();\n");
+			fprintf (f, "\t\tif (++frame == %s_frames) frame = 0;\n", globalOpts.name);
+			fprintf (f, "\t\tVBK_REG = 1;\n");
+			gbdk_bank_switch_output ("att", "\t\t", f);
+			fprintf (f, "\t\tset_%s_tiles(0, 0, %s_cols, %s_rows, %s_att + frame * %s_tsize);\n", func_name, globalOpts.name, globalOpts.name, globalOpts.name, globalOpts.name);
+			fprintf (f, "\t\tVBK_REG = 0;\n");
+			gbdk_bank_switch_output ("map", "\t\t", f);
+			fprintf (f, "\t\tset_%s_tiles(0, 0, %s_cols, %s_rows, %s_map + frame * %s_tsize);\n", func_name, globalOpts.name, globalOpts.name, globalOpts.name, globalOpts.name);
+			fprintf (f, "\t}\n");
+		}else if (globalOpts.frame_w && globalOpts.metasprite){
+			fprintf (f, "\n\twhile (1) {\n");
+			fprintf (f, "\t\tfor (i = 0; i < 8; i++) wait_vbl_done();\n");
+			fprintf (f, "\t\tif (++frame == %s_frames) frame = 0;\n", globalOpts.name);
+			fprintf (f, "\t\t%s_show(0, frame);\n", globalOpts.name);
+			fprintf (f, "\t\t%s_move(0, frame, %dU, %dU);\n", globalOpts.name, (160-gbpic->w)/2 + 8, (144-gbpic->h)/2 + 16);
+			fprintf (f, "\t}\n");
+		}
 		fputs ("\n\treturn 0;\n}\n", f);
 	}
+	if (h){
+		fputs ("\n#endif\n", h);
+		declFile = NULL;
+	}
 	verbose ("-- Done\n\n");
 }
 	
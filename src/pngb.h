@@ -31,6 +31,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 
 /*###########################################################################
  ##                                                                        ##
@@ -46,6 +47,28 @@
 #define LIGHTGRAY_VAL			172
 #define WHITE_VAL				255
 
+#define MIN(a, b) (a < b ? a : b)
+
+/* Tilemap value for cells that have no tile at all (see drop_empty_tiles) */
+#define TILE_EMPTY				((unsigned int)-1)
+
+#define LZ_LEVEL_GREEDY			1
+#define LZ_LEVEL_OPTIMAL		2
+
+/* Tiles we can copy to VRAM in a single VBlank, with the CPU and with HDMA */
+#define VBLANK_CPU_TILES		8
+#define VBLANK_DMA_TILES		64
+
+/* Size of a switchable ROM bank (0x4000-0x7FFF) */
+#define ROM_BANK_SIZE			16384
+/* Last ROM bank SWITCH_ROM_MBC1() can select (the bank table keeps it in a byte too) */
+#define ROM_BANK_LAST			31
+/* Name of the bank files and index shared by the jobs of a run (see banks.c) */
+#define BANK_SHARED_NAME		"pngb_banks"
+
+#define ARENA_BLOCK_SIZE		(1024*1024)
+#define ARENA_ALIGN				16
+
 /*###########################################################################
  ##                                                                        ##
  ##           D A T A   S T R U C T U R E S   A N D   T Y P E S            ##
@@ -78,21 +101,109 @@ typedef struct {
 	int tile_reduction;			/* Set to != 0 to enable redundant tile detection and reduction.		*/
 	BYTE baseindex;				/* Index of the first sprite/tile that will be defined.					*/
 	int verbose;				/* Set to != 0 for detailed log output of the process.					*/
+	int compress_tiles;			/* Set to != 0 to output the tile data LZ compressed.                   */
+	int compress_map;			/* Set to != 0 to output the tile map and attributes LZ compressed.     */
+	int lz_level;				/* LZ_LEVEL_GREEDY or LZ_LEVEL_OPTIMAL.                                 */
+	int frame_w;				/* Animation frame width in pixels (0 if the image is not a sheet).     */
+	int frame_h;				/* Animation frame height in pixels.                                    */
+	int rect_x;					/* Left of the region to convert, in pixels.                            */
+	int rect_y;					/* Top of the region to convert, in pixels.                             */
+	int rect_w;					/* Width of the region to convert (0 converts the whole picture).       */
+	int rect_h;					/* Height of the region to convert.                                     */
+	int lossy_bits;				/* Merge tiles that differ in up to this many bits (0 = exact only).    */
+	int tile_budget;			/* Merge similar tiles until no more than this many remain (0 = off).   */
+	int rom_bank;				/* First ROM bank for the data (0 keeps everything in the home bank).   */
+	int split_header;			/* Set to != 0 to output the declarations to a .h next to the .c file.  */
+	int metasprite;				/* Set to != 0 to output sprites as a metasprite without empty tiles.   */
+	int large_map;				/* Set to != 0 to output streaming code for maps larger than 32x32.     */
+	int vram_loader;			/* Set to != 0 to output a VBlank-batched (HDMA on GBC) VRAM loader.    */
+	int vblank_tiles;			/* Tiles the loader copies with the CPU on every VBlank.                */
+	int vram_bank1;				/* Set to != 0 to put BG tiles that don't fit in bank 0 in GBC bank 1.  */
+	int stream_slots;			/* VRAM slots large maps stream their tiles through (0 = off).          */
 	char name[256];				/* Sprite/tileset name.                                                 */
+	char base_tileset[256];		/* Prebuilt .2bpp tile set already in VRAM at the base index.           */
+	char tiledb[256];			/* Tile database file that keeps tile indexes stable ("" = none).       */
+	char incremental[256];		/* Sidecar with the previous run's tiles and map ("" = none).           */
+	char delta_file[256];		/* Where to write the tiles and map cells changed since the last run.   */
 } OPTIONS;
 
 typedef struct{
-	int w;						/* original width.                                                      */
-	int h;						/* original height.                                                     */
+	int w;						/* original width (frame width for animation sheets).                   */
+	int h;						/* original height (frame height for animation sheets).                 */
 	int cols; 					/* width in tiles.                                                      */
-	int rows;					/* height in tiles.                                                     */
+	int rows;					/* height in tiles (all frames stacked for animation sheets).           */
+	int frames;					/* animation frames; each one is cols x rows/frames tiles.              */
 	int tileh;					/* either 8 or 16.                                                      */
 	int total_tiles;			/* total tiles.                                                         */
+	int base_tiles;				/* The first tiles come from -base-tiles; already in VRAM, not output.  */
+	int bank1_tiles;			/* The last tiles go to GBC VRAM bank 1 (see split_vram_banks).         */
 	BYTE *tiles; 				/* Each tile is either 16 bytes in size (8x8 tiles) or 32 (8x16 tiles). */
 	unsigned int *tilemap;		/* A tilemap of the image. this will be cols x rows in size.            */
+	unsigned int *tile_slot;	/* VRAM slot of each tile when they are streamed (see stream.c).        */
+	int stream_slots;			/* VRAM slots the tiles are streamed through (0 = not streamed).        */
 	unsigned short int pal[4];	/* Each palette entry is 15 bits (For GBC).                             */
 }PICDATA;
 
+typedef struct ARENA ARENA;
+
+typedef struct ARENA_BLOCK{
+	ARENA *owner;				/* Arena this block belongs to.                                         */
+	struct ARENA_BLOCK *next;	/* Next block in the arena.                                             */
+	size_t size;				/* Usable bytes in this block.                                          */
+	size_t used;				/* Bytes handed out so far.                                             */
+}ARENA_BLOCK;
+
+struct ARENA{
+	ARENA_BLOCK *blocks;		/* Every block the arena owns. They are kept between resets.            */
+	ARENA_BLOCK *current;		/* Block we are currently allocating from.                              */
+	size_t reserved;			/* Total bytes requested from the heap.                                 */
+	size_t in_use;				/* Bytes handed out since the last reset.                               */
+	size_t peak;				/* Highest "in_use" value seen.                                         */
+};
+
+/* Node of the BK-tree used to find similar tiles (see do_lossy_reduction) */
+typedef struct{
+	unsigned int tile;			/* Tile held by this node.                                              */
+	unsigned int child;			/* First child node (TILE_EMPTY if none).                               */
+	unsigned int next;			/* Next sibling node (TILE_EMPTY if none).                              */
+	int dist;					/* Distance between this tile and the parent's.                         */
+}BK_NODE;
+
+/* Per-tile state while fitting a tile budget (see fit_tile_budget) */
+typedef struct{
+	int alive;					/* Still in the tile set.                                               */
+	long uses;					/* Map cells that show this tile (including the ones merged into it).   */
+	unsigned int nearest;		/* Closest live tile.                                                   */
+	long dist;					/* Distance to 'nearest' (see tile_shade_distance).                     */
+	long cost;					/* Visible error of merging this tile into 'nearest'.                   */
+	unsigned int owner;			/* Tile that took over this one's cells once merged.                    */
+}BUDGET_TILE;
+
+typedef struct{
+	char symbol[280];			/* C name of the array holding the chunk.                               */
+	BYTE *data;					/* A copy of the chunk data.                                            */
+	size_t size;				/* Chunk size in bytes (never more than ROM_BANK_SIZE).                 */
+	int asset;					/* Asset the chunk belongs to.                                          */
+	int group;					/* Chunks of the same group (!= 0) are placed in the same bank.         */
+	int bank;					/* ROM bank assigned by bank_pack().                                    */
+}BANK_CHUNK;
+
+typedef struct{
+	char symbol[280];			/* C name of the whole asset.                                           */
+	int first_chunk;			/* Index of its first chunk.                                            */
+	int chunks;					/* How many chunks it was split into.                                   */
+}BANK_ASSET;
+
+/* A tar archive being read (see tar.c) */
+typedef struct{
+	const char *filename;		/* Archive file name.                                                   */
+	FILE *f;
+	char name[512];				/* Path of the current member.                                          */
+	BYTE *data;					/* Contents of the current member (NUL terminated).                     */
+	size_t size;				/* Size of the current member.                                          */
+	size_t allocated;			/* Bytes allocated for 'data'; it's reused by every member.             */
+}TAR_READER;
+
 /*###########################################################################
  ##                                                                        ##
  ##                             F U N C T I O N S                          ##
@@ -100,11 +211,67 @@ typedef struct{
  ###########################################################################*/
 void	error (const char * format, ...);
 void	verbose (const char * format, ...);
+int		has_extension (const char *name, const char *ext);
 PICDATA	*process_image (const char* filename);
+PICDATA	*process_png_data (const char* filename, const BYTE *png, size_t size);
+void	decode_workspace_release (void);
+int		is8x16Mode (void);
 void	free_gb_pict (PICDATA *data);
 void	gb_check_warnings (PICDATA *gbpic);
-void	gbdk_c_code_output (PICDATA *gbpic, FILE *f);
+void	gbdk_c_code_output (PICDATA *gbpic, FILE *f, FILE *h, const char *hname);
+FILE	*gbdk_decl_file (FILE *f);
+void	gbdk_decl_output (FILE *f, const char *format, ...);
+void	gbdk_data_array_output (const char *suffix, BYTE *data, size_t len, size_t unit, int group, FILE *f);
+void	gbdk_bank_switch_output (const char *suffix, const char *indent, FILE *f);
 void	code_disclaimer_c (char *inputfile, char *outputfile, FILE *f);
+void	c_byte_array_output (BYTE *data, size_t len, FILE *f);
+
+size_t	lz_bound (size_t len);
+size_t	lz_compress (const BYTE *src, size_t len, BYTE *dst, int level);
+void	gbdk_lz_decoder_output (FILE *f);
+
+int		bank_new_group (void);
+int		bank_add_asset (const char *symbol, const BYTE *data, size_t size, size_t unit, int group);
+int		bank_pack (int first);
+void	bank_share (void);
+int		bank_shared (void);
+void	bank_share_job (const char *outputfile, int first);
+int		bank_shared_jobs (void);
+const char	*bank_index_name (void);
+void	bank_reset (void);
+void	gbdk_bank_externs_output (int asset, FILE *f);
+void	gbdk_bank_index_output (const char *name, FILE *f);
+void	gbdk_shared_banks_output (void);
+void	gbdk_bank_files_output (char *inputfile, char *outputfile);
+
+void	tiledb_apply (PICDATA *pic, const char *filename);
+void	tiledb_release (void);
+unsigned int	read_le32 (const BYTE *p);
+void	write_le32 (BYTE *p, unsigned int n);
+unsigned int	hash_tile_data (const BYTE *data, unsigned int size);
+
+int		incremental_reduction (PICDATA *pic, const char *filename);
+void	incremental_save (PICDATA *pic, const char *filename);
+
+void	stream_plan (PICDATA *pic, int slots);
+void	gbdk_stream_tables_output (PICDATA *pic, FILE *f);
+void	gbdk_tile_streaming_output (PICDATA *pic, FILE *f);
+
+int		preflight_check (char **paths, int count);
+
+void	tar_open (TAR_READER *tar, const char *filename);
+int		tar_next (TAR_READER *tar);
+void	tar_close (TAR_READER *tar);
+
+void	*arena_alloc (ARENA *a, size_t size);
+void	*arena_realloc (ARENA *a, void *ptr, size_t new_size);
+void	arena_free (void *ptr);
+void	arena_reset (ARENA *a);
+void	arena_release (ARENA *a);
+/* LodePNG allocator hooks (see arena.c) */
+void	*lodepng_malloc (size_t size);
+void	*lodepng_realloc (void *ptr, size_t new_size);
+void	lodepng_free (void *ptr);
 
 /*###########################################################################
  ##                                                                        ##
@@ -113,5 +280,7 @@ void	code_disclaimer_c (char *inputfile, char *outputfile, FILE *f);
  ###########################################################################*/
 /* Global options. Affect the whole process */
 extern OPTIONS globalOpts;
+/* Arena used for every allocation made while converting a picture */
+extern ARENA jobArena;
 
 #endif
@@ -0,0 +1,397 @@
+/*****************************************************************************
+**	stream.c
+**
+**	VRAM tile streaming for the PNGB graphics converter.
+**	Large maps (-L) can have many more tiles than VRAM holds. With -slots,
+**	only the tiles around the camera are kept in VRAM: every tile gets a
+**	fixed VRAM slot, chosen so that no two tiles that can be on screen (or
+**	about to be) at the same time share one. The map then holds slots
+**	instead of tiles, and the game only has to upload the tiles of the
+**	rows and columns the camera is getting close to, a batch per frame.
+**
+**	The area kept in VRAM is the screen plus STREAM_MARGIN tiles on every
+**	side, so the uploads for a new row/column have that many tiles of
+**	scrolling to finish before the row/column shows up. Free slots are
+**	reused least recently used first (in map reading order), so a tile
+**	that was just left behind is the last one to be overwritten.
+**
+** 	Copyright (c) 2015 Elias Zacarias
+**
+** 	Permission is hereby granted, free of charge, to any person obtaining a
+** 	copy of this software and associated documentation files (the "Software"),
+** 	to deal in the Software without restriction, including without limitation
+** 	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+** 	and/or sell copies of the Software, and to permit persons to whom the
+** 	Software is furnished to do so, subject to the following conditions:
+**
+** 	The above copyright notice and this permission notice shall be included in
+** 	all copies or substantial portions of the Software.
+
+** 	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** 	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** 	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** 	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** 	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+** 	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+** 	IN THE SOFTWARE.
+**
+*****************************************************************************/
+#include "pngb.h"
+
+#define STREAM_MARGIN		2		/* Tiles kept in VRAM around the screen, on every side */
+#define STREAM_QUEUE		128		/* Uploads that can be pending at once (a power of 2) */
+
+/* Cells of every tile while planning: tile 't' is at tileCells[tileFirst[t]]
+to tileCells[tileFirst[t+1]-1], in reading order */
+static unsigned int *tileFirst	= NULL;
+static unsigned int *tileCells	= NULL;
+
+/*###########################################################################
+ ##                                                                        ##
+ ##                     A U X    F U N C T I O N S                         ##
+ ##                                                                        ##
+ ###########################################################################*/
+/*** window_size ************************************************************
+ * Size in tiles of the area kept in VRAM: the screen (21x19 tiles while    *
+ * scrolled between tiles) plus the margin, within the map.                 *
+ ****************************************************************************/
+static void window_size(PICDATA *pic, int *ww, int *wh){
+	*ww = MIN(MIN(pic->cols, 21) + 2*STREAM_MARGIN, pic->cols);
+	*wh = MIN(MIN(pic->rows, 19) + 2*STREAM_MARGIN, pic->rows);
+}
+
+/*** add_cells **************************************************************
+ * Adds (or removes, with 'step' = -1) a w x h block of map cells to the    *
+ * tile counts of a window. Returns how many tiles went from 0 to 1 uses.   *
+ ****************************************************************************/
+static int add_cells(PICDATA *pic, int *count, int x, int y, int w, int h, int step, int *distinct){
+	int cx, cy, added = 0;
+	unsigned int t;
+
+	for (cy=y; cy<y+h; cy++){
+		for (cx=x; cx<x+w; cx++){
+			t = pic->tilemap[cy*pic->cols + cx];
+			if (step > 0 && count[t]++ == 0) added++;
+			if (step < 0 && --count[t] == 0) (*distinct)--;
+		}
+	}
+	*distinct += added;
+	return added;
+}
+
+/*** window_stats ***********************************************************
+ * Slides the VRAM window over the whole map, one tile at a time. Finds the *
+ * most tiles it ever holds at once, and the most tiles that one step left  *
+ * or right ('hstep') and up or down ('vstep') can bring in.                *
+ ****************************************************************************/
+static void window_stats(PICDATA *pic, int *maxset, int *hstep, int *vstep){
+	int *count = (int *)arena_alloc(&jobArena, pic->total_tiles*sizeof(int));
+	int ww, wh, x, y, n, distinct;
+
+	window_size (pic, &ww, &wh);
+	*maxset = *hstep = *vstep = 0;
+	for (y=0; y+wh<=pic->rows; y++){
+		memset (count, 0, pic->total_tiles*sizeof(int));
+		distinct = 0;
+		add_cells (pic, count, 0, y, ww, wh, 1, &distinct);
+		if (distinct > *maxset) *maxset = distinct;
+		for (x=1; x+ww<=pic->cols; x++){
+			/* Tiles still in the column that scrolled away don't have to be loaded */
+			n = add_cells(pic, count, x + ww - 1, y, 1, wh, 1, &distinct);
+			add_cells (pic, count, x - 1, y, 1, wh, -1, &distinct);
+			if (n > *hstep) *hstep = n;
+			if (distinct > *maxset) *maxset = distinct;
+		}
+	}
+	for (x=0; x+ww<=pic->cols; x++){
+		memset (count, 0, pic->total_tiles*sizeof(int));
+		distinct = 0;
+		add_cells (pic, count, x, 0, ww, wh, 1, &distinct);
+		for (y=1; y+wh<=pic->rows; y++){
+			n = add_cells(pic, count, x, y + wh - 1, ww, 1, 1, &distinct);
+			add_cells (pic, count, x, y - 1, ww, 1, -1, &distinct);
+			if (n > *vstep) *vstep = n;
+		}
+	}
+	arena_free (count);
+}
+
+/*** mark_neighbor_slots ****************************************************
+ * Marks with 'stamp' the slots of every tile that can be in VRAM together  *
+ * with the one at cell (x, y): the ones that are less than a window away.  *
+ ****************************************************************************/
+static void mark_neighbor_slots(PICDATA *pic, int x, int y, int ww, int wh, unsigned int *used, unsigned int stamp){
+	int x0 = (x - ww + 1 < 0 ? 0 : x - ww + 1), x1 = MIN(x + ww, pic->cols);
+	int y0 = (y - wh + 1 < 0 ? 0 : y - wh + 1), y1 = MIN(y + wh, pic->rows);
+	unsigned int s;
+
+	for (; y0<y1; y0++){
+		for (x=x0; x<x1; x++){
+			s = pic->tile_slot[pic->tilemap[y0*pic->cols + x]];
+			if (s != TILE_EMPTY) used[s] = stamp;
+		}
+	}
+}
+
+/*###########################################################################
+ ##                                                                        ##
+ ##                         S L O T   P L A N N I N G                      ##
+ ##                                                                        ##
+ ###########################################################################*/
+/*** assign_slots ***********************************************************
+ * Places every tile (in the order the map first shows it) in a slot below  *
+ * 'slots' that none of its neighbors (see mark_neighbor_slots) has. 'lru'  *
+ * picks the free slot whose tiles were needed longest ago in reading order *
+ * (so the tiles that share a slot are far apart), otherwise the lowest one *
+ * is taken. Returns the cell where it ran out of slots, or -1.             *
+ ****************************************************************************/
+static int assign_slots(PICDATA *pic, int slots, int lru, unsigned int *used, long *lastuse){
+	int ww, wh, c, i, s, best, cells = pic->cols*pic->rows;
+	unsigned int t;
+
+	window_size (pic, &ww, &wh);
+	for (t=pic->base_tiles; t<(unsigned int)pic->total_tiles; t++) pic->tile_slot[t] = TILE_EMPTY;
+	memset (used, 0, slots*sizeof(unsigned int));
+	for (s=0; s<slots; s++) lastuse[s] = -1;
+
+	for (c=0; c<cells; c++){
+		t = pic->tilemap[c];
+		if (pic->tile_slot[t] != TILE_EMPTY) continue;
+		for (i=tileFirst[t]; i<(int)tileFirst[t+1]; i++) mark_neighbor_slots (pic, tileCells[i] % pic->cols, tileCells[i] / pic->cols, ww, wh, used, c + 1);
+
+		best = -1;
+		for (s=pic->base_tiles; s<slots; s++){
+			if (used[s] == (unsigned int)c + 1) continue;
+			if (best < 0 || lastuse[s] < lastuse[best]) best = s;
+			if (!lru) break;
+		}
+		if (best < 0) return c;
+		pic->tile_slot[t] = best;
+		lastuse[best] = tileCells[tileFirst[t+1] - 1];
+	}
+	return -1;
+}
+
+/*** stream_plan ************************************************************
+ * Gives every tile of a large map one of 'slots' VRAM slots (pic->         *
+ * tile_slot), so that the tiles of any window of the map (see window_size) *
+ * are all in different slots. Tiles from -base-tiles keep their place.     *
+ * Aborts if the slots aren't enough.                                       *
+ ****************************************************************************/
+void stream_plan(PICDATA *pic, int slots){
+	int cells = pic->cols*pic->rows, room = 256 - globalOpts.baseindex;
+	int ww, wh, maxset, hstep, vstep, c, needed;
+	unsigned int t, *count, *used;
+	long *lastuse;
+
+	verbose ("\n<PLANNING THE TILE STREAMING>\n");
+	if (slots <= pic->base_tiles) error ("ERROR: The %d VRAM slots are all taken by the base tiles (-base-tiles).", slots);
+
+	pic->tile_slot = (unsigned int *)arena_alloc(&jobArena, pic->total_tiles*sizeof(unsigned int));
+	for (t=0; t<(unsigned int)pic->base_tiles; t++) pic->tile_slot[t] = t;
+
+	window_size (pic, &ww, &wh);
+	window_stats (pic, &maxset, &hstep, &vstep);
+	if (maxset > slots) error ("ERROR: Up to %d different tiles can be in a %dx%d tile area of the map, which\n\tmakes %d VRAM slots not enough to stream it (-slots).", maxset, ww, wh, slots);
+
+	/* Cells of every tile, in reading order */
+	tileFirst	= (unsigned int *)arena_alloc(&jobArena, (pic->total_tiles + 1)*sizeof(unsigned int));
+	count		= (unsigned int *)arena_alloc(&jobArena, pic->total_tiles*sizeof(unsigned int));
+	tileCells	= (unsigned int *)arena_alloc(&jobArena, cells*sizeof(unsigned int));
+	memset (count, 0, pic->total_tiles*sizeof(unsigned int));
+	for (c=0; c<cells; c++) count[pic->tilemap[c]]++;
+	tileFirst[0] = 0;
+	for (t=0; t<(unsigned int)pic->total_tiles; t++) tileFirst[t+1] = tileFirst[t] + count[t];
+	memset (count, 0, pic->total_tiles*sizeof(unsigned int));
+	for (c=0; c<cells; c++){
+		t = pic->tilemap[c];
+		tileCells[tileFirst[t] + count[t]++] = c;
+	}
+
+	/* Every tile can always get a slot of its own, so 'total_tiles' slots never run out */
+	used	= (unsigned int *)arena_alloc(&jobArena, pic->total_tiles*sizeof(unsigned int));
+	lastuse	= (long *)arena_alloc(&jobArena, pic->total_tiles*sizeof(long));
+	if (assign_slots(pic, slots, 1, used, lastuse) >= 0){
+		/* Packing the tiles in the lowest free slots may still fit */
+		assign_slots (pic, pic->total_tiles, 0, used, lastuse);
+		for (needed=0, t=0; t<(unsigned int)pic->total_tiles; t++) if (pic->tile_slot[t] != TILE_EMPTY && (int)pic->tile_slot[t] >= needed) needed = pic->tile_slot[t] + 1;
+		if (needed > slots) error ("ERROR: Streaming the map takes %d VRAM slots (-slots): tiles that are\n\tless than a screen apart can't share one, and there are %d of them at most\n\tin a %dx%d tile area.", needed, maxset, ww, wh);
+		verbose ("-- Least recently used placement ran out of slots; packed into %d slots\n", needed);
+	}
+
+	arena_free (lastuse);
+	arena_free (used);
+	arena_free (tileCells);
+	arena_free (count);
+	arena_free (tileFirst);
+	tileFirst = tileCells = NULL;
+
+	/* Tiles that no cell shows are never uploaded */
+	for (t=0; t<(unsigned int)pic->total_tiles; t++) if (pic->tile_slot[t] == TILE_EMPTY) pic->tile_slot[t] = 0;
+	pic->stream_slots = slots;
+
+	verbose ("-- %d tiles streamed through %d VRAM slots%s; up to %d of them in a %dx%d tile area\n", pic->total_tiles, slots, (slots > room ? " (in banks 0 and 1)" : ""), maxset, ww, wh);
+	verbose ("-- Scrolling a tile loads up to %d tiles horizontally, %d vertically\n", hstep, vstep);
+	if (hstep < vstep) hstep = vstep;
+	if (hstep > 8*globalOpts.vblank_tiles){
+		printf("\nWARNING: Scrolling one tile can take up to %d tile uploads, more than the %d\n\tthat 8 frames of %d (-batch) allow. Scrolling 1 pixel per frame may show\n\ttiles before they are loaded.\n", hstep, 8*globalOpts.vblank_tiles, globalOpts.vblank_tiles);
+	}
+}
+
+/*###########################################################################
+ ##                                                                        ##
+ ##                      O U T P U T   G E N E R A T I O N                 ##
+ ##                                                                        ##
+ ###########################################################################*/
+/*** gbdk_word_table_output *************************************************
+ * Outputs a table of 16-bit values as name_suffix[]. In ROM bank mode it   *
+ * goes to the bank files as little endian bytes, and may be split between  *
+ * banks at any entry.                                                      *
+ ****************************************************************************/
+static void gbdk_word_table_output(const char *suffix, unsigned int *values, int count, int per_line, FILE *f){
+	int i;
+
+	if (globalOpts.rom_bank){
+		BYTE *bytes = (BYTE *)arena_alloc(&jobArena, count*2);
+		for (i=0; i<count; i++){
+			bytes[i*2]		= values[i] & 0xff;
+			bytes[i*2 + 1]	= (values[i] >> 8) & 0xff;
+		}
+		gbdk_data_array_output (suffix, bytes, count*2, 2, 0, f);
+		arena_free (bytes);
+		return;
+	}
+	gbdk_decl_output (f, "const unsigned int %s_%s[]", globalOpts.name, suffix);
+	fputs (" = {", f);
+	for (i=0; i<count; i++){
+		if (i % per_line == 0) fputs ("\n\t", f);
+		fprintf (f, "0x%04x", values[i]);
+		if (i < count-1) fputs (", ", f);
+	}
+	fputs ("\n};\n\n", f);
+}
+
+/*** gbdk_stream_tables_output **********************************************
+ * Outputs the tables the streaming code needs: the tile of every map cell  *
+ * (name_tile_ids) and the VRAM slot of every tile (name_tile_slots).       *
+ ****************************************************************************/
+void gbdk_stream_tables_output(PICDATA *pic, FILE *f){
+	char *n = globalOpts.name;
+	unsigned int *ids;
+	int c, cells = pic->cols*pic->rows;
+
+	fprintf (gbdk_decl_file(f), "#define %s_slots\t%d\n", n, pic->stream_slots);
+	fprintf (gbdk_decl_file(f), "#define %s_bank_slots\t%d\n", n, 256 - globalOpts.baseindex);
+	fprintf (gbdk_decl_file(f), "#define %s_fixed_slots\t%d\n", n, pic->base_tiles);
+	fprintf (gbdk_decl_file(f), "#define %s_stream_margin\t%d\n", n, STREAM_MARGIN);
+	fprintf (gbdk_decl_file(f), "#define %s_stream_batch\t%d\n", n, globalOpts.vblank_tiles);
+	fprintf (gbdk_decl_file(f), "#define %s_queue_size\t%d\n\n", n, STREAM_QUEUE);
+
+	/* The tile map proper isn't kept: the map arrays hold slots */
+	ids = (unsigned int *)arena_alloc(&jobArena, cells*sizeof(unsigned int));
+	for (c=0; c<cells; c++) ids[c] = pic->tilemap[c];
+	fprintf (f, "/* Tile shown by every map cell, and VRAM slot of every tile. %s_dat[] starts at tile %s_fixed_slots. */\n", n, n);
+	gbdk_word_table_output ("tile_ids", ids, cells, pic->cols, f);
+	arena_free (ids);
+	gbdk_word_table_output ("tile_slots", pic->tile_slot, pic->total_tiles, 8, f);
+}
+
+/*** gbdk_tile_streaming_output *********************************************
+ * Outputs the code that keeps the tiles around the camera in VRAM: a queue *
+ * of uploads that the map streaming code fills as the camera moves, and    *
+ * that is emptied a batch at a time every frame.                           *
+ ****************************************************************************/
+void gbdk_tile_streaming_output(PICDATA *pic, FILE *f){
+	char *n = globalOpts.name;
+	int banks = (pic->stream_slots > 256 - globalOpts.baseindex);
+
+	gbdk_decl_output (f, "unsigned int %s_resident[%s_slots]", n, n);
+	fputs (";\n", f);
+	fprintf (f, "unsigned int %s_queue_tile[%s_queue_size], %s_queue_slot[%s_queue_size];\n", n, n, n, n);
+	fprintf (f, "unsigned char %s_queue_head, %s_queue_len;\n\n", n, n);
+
+	if (globalOpts.rom_bank){
+		fprintf (f, "/* Reads entry 'i' of a table of words that starts at chunk 'chunk' of %s_chunks[]. */\n", bank_index_name());
+		fprintf (f, "unsigned int %s_read_word(unsigned int chunk, unsigned int i) {\n", n);
+		fprintf (f, "\tconst pngb_bank_chunk *c = &%s_chunks[chunk + (i >> 13)];\n", bank_index_name());
+		fprintf (f, "\tconst unsigned char *p = c->data + ((i & 0x1FFF) << 1);\n\n");
+		fprintf (f, "\tSWITCH_ROM_MBC1(c->bank);\n");
+		fprintf (f, "\treturn p[0] | ((unsigned int)p[1] << 8);\n");
+		fprintf (f, "}\n\n");
+	}
+
+	fprintf (f, "/* Uploads up to %s_stream_batch of the queued tiles. Call it once every frame, right after VBlank starts. */\n", n);
+	gbdk_decl_output (f, "void %s_stream_tiles(void)", n);
+	fputs (" {\n", f);
+	fprintf (f, "\tunsigned char count;\n");
+	fprintf (f, "\tunsigned int t, s;\n");
+	if (globalOpts.rom_bank) fprintf (f, "\tconst pngb_bank_chunk *c;\n");
+	fputs ("\n", f);
+	fprintf (f, "\tfor (count = 0; count < %s_stream_batch && %s_queue_len; count++) {\n", n, n);
+	fprintf (f, "\t\tt = %s_queue_tile[%s_queue_head] - %s_fixed_slots;\n", n, n, n);
+	fprintf (f, "\t\ts = %s_queue_slot[%s_queue_head];\n", n, n);
+	fprintf (f, "\t\t%s_queue_head = (%s_queue_head + 1) & (%s_queue_size - 1);\n", n, n, n);
+	fprintf (f, "\t\t%s_queue_len--;\n", n);
+	if (banks){
+		/* Slots past the first bank are the same indexes in VRAM bank 1 */
+		fprintf (f, "\t\tVBK_REG = (s >= %s_bank_slots);\n", n);
+		fprintf (f, "\t\tif (s >= %s_bank_slots) s -= %s_bank_slots;\n", n, n);
+	}
+	if (globalOpts.rom_bank){
+		/* 1024 tiles fit in a bank, so that's where the tile data is split */
+		fprintf (f, "\t\tc = &%s_chunks[%s_dat_chunk + (t >> 10)];\n", bank_index_name(), n);
+		fprintf (f, "\t\tSWITCH_ROM_MBC1(c->bank);\n");
+		fprintf (f, "\t\tset_bkg_data(%s_base + s, 1, c->data + ((t & 0x3FF) << 4));\n", n);
+	}else {
+		fprintf (f, "\t\tset_bkg_data(%s_base + s, 1, %s_dat + (t << 4));\n", n, n);
+	}
+	fprintf (f, "\t}\n");
+	if (banks) fprintf (f, "\tVBK_REG = 0;\n");
+	fprintf (f, "}\n\n");
+
+	fprintf (f, "/* Queues the tile of map cell 'cell' for upload, unless its slot already holds it. */\n");
+	gbdk_decl_output (f, "void %s_need_tile(unsigned int cell)", n);
+	fputs (" {\n", f);
+	if (globalOpts.rom_bank){
+		fprintf (f, "\tunsigned int t = %s_read_word(%s_tile_ids_chunk, cell);\n", n, n);
+		fprintf (f, "\tunsigned int s = %s_read_word(%s_tile_slots_chunk, t);\n", n, n);
+	}else {
+		fprintf (f, "\tunsigned int t = %s_tile_ids[cell];\n", n);
+		fprintf (f, "\tunsigned int s = %s_tile_slots[t];\n", n);
+	}
+	fprintf (f, "\tunsigned char q;\n\n");
+	fprintf (f, "\tif (%s_resident[s] == t) return;\n", n);
+	fprintf (f, "\t%s_resident[s] = t;\n", n);
+	fprintf (f, "\t/* The queue only fills up when the camera jumps far away */\n");
+	fprintf (f, "\twhile (%s_queue_len == %s_queue_size) {\n", n, n);
+	fprintf (f, "\t\twait_vbl_done();\n");
+	fprintf (f, "\t\t%s_stream_tiles();\n", n);
+	fprintf (f, "\t}\n");
+	fprintf (f, "\tq = (%s_queue_head + %s_queue_len++) & (%s_queue_size - 1);\n", n, n, n);
+	fprintf (f, "\t%s_queue_tile[q] = t;\n", n);
+	fprintf (f, "\t%s_queue_slot[q] = s;\n", n);
+	fprintf (f, "}\n\n");
+
+	fprintf (f, "/* Queues the tiles of the w x h map cells at (col, row) that aren't in VRAM. Cells outside the map are skipped. */\n");
+	gbdk_decl_output (f, "void %s_prefetch(int col, int row, int w, int h)", n);
+	fputs (" {\n", f);
+	fprintf (f, "\tint x, y;\n\n");
+	fprintf (f, "\tif (col < 0) { w += col; col = 0; }\n");
+	fprintf (f, "\tif (row < 0) { h += row; row = 0; }\n");
+	fprintf (f, "\tif (col + w > %s_cols) w = %s_cols - col;\n", n, n);
+	fprintf (f, "\tif (row + h > %s_rows) h = %s_rows - row;\n", n, n);
+	fprintf (f, "\tfor (y = 0; y < h; y++) {\n");
+	fprintf (f, "\t\tfor (x = 0; x < w; x++) %s_need_tile((unsigned int)(row + y) * %s_cols + col + x);\n", n, n);
+	fprintf (f, "\t}\n");
+	fprintf (f, "}\n\n");
+
+	fprintf (f, "/* Loads every tile around camera position (x, y), in pixels. Call it with the display off, before %s_stream_init(). */\n", n);
+	gbdk_decl_output (f, "void %s_stream_tiles_init(unsigned int x, unsigned int y)", n);
+	fputs (" {\n", f);
+	fprintf (f, "\tunsigned int s;\n\n");
+	fprintf (f, "\tfor (s = 0; s < %s_slots; s++) %s_resident[s] = (s < %s_fixed_slots ? s : 0xFFFF);\n", n, n, n);
+	fprintf (f, "\t%s_queue_head = %s_queue_len = 0;\n", n, n);
+	fprintf (f, "\t%s_prefetch((int)(x >> 3) - %s_stream_margin, (int)(y >> 3) - %s_stream_margin, %s_view_cols + 2*%s_stream_margin, %s_view_rows + 2*%s_stream_margin);\n", n, n, n, n, n, n, n);
+	fprintf (f, "\twhile (%s_queue_len) %s_stream_tiles();\n", n, n);
+	fprintf (f, "}\n\n");
+}
@@ -0,0 +1,173 @@
+/*****************************************************************************
+**	tar.c
+**
+**	Tar archive reader for the PNGB graphics converter.
+**	Lets a whole pack of PNGs be converted from a single uncompressed tar
+**	file, read front to back in one pass. Every member is read into the same
+**	buffer, which only grows, so no temporary files (or per-member heap
+**	allocations) are needed.
+**
+**	Plain ustar archives are supported, plus the GNU long name extension.
+**	Anything that isn't a regular file (directories, links, pax headers...)
+**	is skipped.
+**
+** 	Copyright (c) 2015 Elias Zacarias
+**
+** 	Permission is hereby granted, free of charge, to any person obtaining a
+** 	copy of this software and associated documentation files (the "Software"),
+** 	to deal in the Software without restriction, including without limitation
+** 	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+** 	and/or sell copies of the Software, and to permit persons to whom the
+** 	Software is furnished to do so, subject to the following conditions:
+**
+** 	The above copyright notice and this permission notice shall be included in
+** 	all copies or substantial portions of the Software.
+
+** 	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** 	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** 	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** 	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** 	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+** 	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+** 	IN THE SOFTWARE.
+**
+*****************************************************************************/
+#include "pngb.h"
+
+#define TAR_BLOCK			512
+
+/* Where the fields we need are in a tar header block */
+#define TAR_NAME			0
+#define TAR_NAME_LEN		100
+#define TAR_SIZE			124
+#define TAR_SIZE_LEN		12
+#define TAR_CHECKSUM		148
+#define TAR_CHECKSUM_LEN	8
+#define TAR_TYPE			156
+#define TAR_MAGIC			257
+#define TAR_PREFIX			345
+#define TAR_PREFIX_LEN		155
+
+/*###########################################################################
+ ##                                                                        ##
+ ##                     A U X    F U N C T I O N S                         ##
+ ##                                                                        ##
+ ###########################################################################*/
+/*** parse_octal ************************************************************
+ * Reads a (space or NUL terminated) octal number of a tar header.          *
+ ****************************************************************************/
+static size_t parse_octal(const BYTE *field, int len){
+	size_t n = 0;
+	int i = 0;
+
+	while (i < len && field[i] == ' ') i++;
+	for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) n = n*8 + (field[i] - '0');
+	return n;
+}
+
+/*** valid_header ***********************************************************
+ * Tells if a block is a tar header, checking its checksum (the sum of all  *
+ * of its bytes, with the checksum field itself counted as spaces).         *
+ ****************************************************************************/
+static int valid_header(const BYTE *block){
+	unsigned int i, sum = 0;
+
+	for (i=0; i<TAR_BLOCK; i++){
+		sum += (i >= TAR_CHECKSUM && i < TAR_CHECKSUM + TAR_CHECKSUM_LEN ? ' ' : block[i]);
+	}
+	return (sum == parse_octal(&block[TAR_CHECKSUM], TAR_CHECKSUM_LEN));
+}
+
+/*** is_zero_block **********************************************************
+ * Tells if a block is all zeros, which marks the end of the archive.       *
+ ****************************************************************************/
+static int is_zero_block(const BYTE *block){
+	int i;
+	for (i=0; i<TAR_BLOCK; i++) if (block[i]) return 0;
+	return 1;
+}
+
+/*** read_member_data *******************************************************
+ * Reads 'size' bytes of member data (and the padding up to the next block) *
+ * into the reader buffer, growing it if needed.                            *
+ ****************************************************************************/
+static void read_member_data(TAR_READER *tar, size_t size){
+	size_t padded = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+
+	if (padded + 1 > tar->allocated){
+		free (tar->data);
+		tar->allocated	= padded + 1;
+		tar->data		= (BYTE *)malloc(tar->allocated);
+		if (!tar->data) error ("ERROR: Out of memory (requested %lu bytes).", (unsigned long)tar->allocated);
+	}
+	if (fread(tar->data, 1, padded, tar->f) != padded) error ("ERROR: %s is truncated.", tar->filename);
+	tar->data[size] = '\0';
+	tar->size = size;
+}
+
+/*###########################################################################
+ ##                                                                        ##
+ ##                         T A R   A R C H I V E S                        ##
+ ##                                                                        ##
+ ###########################################################################*/
+/*** tar_open ***************************************************************
+ * Opens a tar archive for reading. Aborts if it can't be opened.           *
+ ****************************************************************************/
+void tar_open(TAR_READER *tar, const char *filename){
+	memset (tar, 0, sizeof(TAR_READER));
+	tar->filename = filename;
+	tar->f = fopen(filename, "rb");
+	if (!tar->f) error ("ERROR: Couldn't open archive %s", filename);
+}
+
+/*** tar_next ***************************************************************
+ * Reads the next regular file of the archive: its path goes to tar->name   *
+ * and its contents to tar->data (tar->size bytes). Returns 0 once the end  *
+ * of the archive is reached.                                               *
+ ****************************************************************************/
+int tar_next(TAR_READER *tar){
+	BYTE block[TAR_BLOCK];
+	char longname[sizeof(tar->name)];
+	size_t size;
+	int type;
+
+	longname[0] = '\0';
+	while (fread(block, 1, TAR_BLOCK, tar->f) == TAR_BLOCK){
+		if (is_zero_block(block)) return 0;
+		if (!valid_header(block)) error ("ERROR: %s is not a tar archive (or is damaged).", tar->filename);
+
+		size = parse_octal(&block[TAR_SIZE], TAR_SIZE_LEN);
+		type = block[TAR_TYPE];
+		read_member_data (tar, size);
+
+		if (type == 'L'){
+			/* GNU extension: the data is the name of the next member */
+			snprintf (longname, sizeof(longname), "%s", (char *)tar->data);
+			continue;
+		}
+		if (type != '0' && type != '\0'){
+			longname[0] = '\0';
+			continue;
+		}
+
+		if (longname[0]){
+			snprintf (tar->name, sizeof(tar->name), "%s", longname);
+		}else if (block[TAR_PREFIX] && !memcmp(&block[TAR_MAGIC], "ustar", 5)){
+			snprintf (tar->name, sizeof(tar->name), "%.*s/%.*s", TAR_PREFIX_LEN, (char *)&block[TAR_PREFIX], TAR_NAME_LEN, (char *)&block[TAR_NAME]);
+		}else {
+			snprintf (tar->name, sizeof(tar->name), "%.*s", TAR_NAME_LEN, (char *)&block[TAR_NAME]);
+		}
+		return 1;
+	}
+	/* Some archivers leave out the end of archive blocks */
+	return 0;
+}
+
+/*** tar_close **************************************************************
+ * Closes the archive and frees the member buffer.                          *
+ ****************************************************************************/
+void tar_close(TAR_READER *tar){
+	if (tar->f) fclose (tar->f);
+	free (tar->data);
+	memset (tar, 0, sizeof(TAR_READER));
+}
@@ -0,0 +1,229 @@
+/*****************************************************************************
+**	tiledb.c
+**
+**	Project tile database for the PNGB graphics converter.
+**	The database is a file that remembers every tile it has ever been given,
+**	in the order they were first seen. Pictures converted against it use the
+**	tile indexes of the database instead of assigning new ones, so editing a
+**	picture never moves the tiles that were already there: new tiles are
+**	only ever appended at the end.
+**
+**	File layout (all numbers little endian):
+**		8 bytes		"PNGBTDB1"
+**		4 bytes		bytes per tile (16 for 8x8 tiles, 32 for 8x16 tiles)
+**		4 bytes		tile count
+**		...			the tiles, in index order
+**
+**	The database is loaded once per run and kept in memory (outside of the
+**	job arena) with a hash index, so several jobs can share it.
+**
+** 	Copyright (c) 2015 Elias Zacarias
+**
+** 	Permission is hereby granted, free of charge, to any person obtaining a
+** 	copy of this software and associated documentation files (the "Software"),
+** 	to deal in the Software without restriction, including without limitation
+** 	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+** 	and/or sell copies of the Software, and to permit persons to whom the
+** 	Software is furnished to do so, subject to the following conditions:
+**
+** 	The above copyright notice and this permission notice shall be included in
+** 	all copies or substantial portions of the Software.
+
+** 	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** 	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** 	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** 	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** 	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+** 	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+** 	IN THE SOFTWARE.
+**
+*****************************************************************************/
+#include "pngb.h"
+
+#define TILEDB_MAGIC		"PNGBTDB1"
+#define TILEDB_HEADER_SIZE	16
+
+static char dbFile[256]		= "";
+static BYTE *dbTiles		= NULL;
+static unsigned int dbTileSize	= 0;
+static unsigned int dbCount		= 0;
+static unsigned int dbCapacity	= 0;
+static unsigned int dbSaved		= 0;
+static unsigned int *dbIndex	= NULL;
+static unsigned int dbSlots		= 0;
+
+/*###########################################################################
+ ##                                                                        ##
+ ##                     A U X    F U N C T I O N S                         ##
+ ##                                                                        ##
+ ###########################################################################*/
+/*** read_le32 **************************************************************
+ * Reads a little endian 32 bit number from a buffer.                       *
+ ****************************************************************************/
+unsigned int read_le32(const BYTE *p){
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+/*** write_le32 *************************************************************
+ * Writes a little endian 32 bit number into a buffer.                      *
+ ****************************************************************************/
+void write_le32(BYTE *p, unsigned int n){
+	p[0] = n & 0xff;
+	p[1] = (n >> 8) & 0xff;
+	p[2] = (n >> 16) & 0xff;
+	p[3] = (n >> 24) & 0xff;
+}
+
+/*** hash_tile_data *********************************************************
+ * Returns a hash (FNV-1a) of 'size' bytes of tile data.                    *
+ ****************************************************************************/
+unsigned int hash_tile_data(const BYTE *data, unsigned int size){
+	unsigned int i, h = 2166136261U;
+	for (i=0; i<size; i++) h = (h ^ data[i]) * 16777619U;
+	return h;
+}
+
+/*** find_slot **************************************************************
+ * Returns the index slot that holds 'data', or the empty slot where it     *
+ * would go.                                                                *
+ ****************************************************************************/
+static unsigned int find_slot(const BYTE *data){
+	unsigned int mask = dbSlots - 1, h = hash_tile_data(data, dbTileSize) & mask;
+	while (dbIndex[h] != TILE_EMPTY && memcmp(&dbTiles[dbIndex[h]*dbTileSize], data, dbTileSize)) h = (h+1) & mask;
+	return h;
+}
+
+/*** rebuild_index **********************************************************
+ * (Re)creates the hash index so it's never more than half full.            *
+ ****************************************************************************/
+static void rebuild_index(unsigned int min_tiles){
+	unsigned int t, slots = 1024;
+
+	while (slots < 2*min_tiles) slots <<= 1;
+	if (slots <= dbSlots) return;
+
+	free (dbIndex);
+	dbSlots	= slots;
+	dbIndex	= (unsigned int *)malloc(dbSlots*sizeof(unsigned int));
+	if (!dbIndex) error ("ERROR: Out of memory.");
+	for (t=0; t<dbSlots; t++) dbIndex[t] = TILE_EMPTY;
+	for (t=0; t<dbCount; t++) dbIndex[find_slot(&dbTiles[t*dbTileSize])] = t;
+}
+
+/*** append_tile ************************************************************
+ * Adds a tile at the end of the database and returns its index.            *
+ ****************************************************************************/
+static unsigned int append_tile(const BYTE *data){
+	if (dbCount == dbCapacity){
+		dbCapacity = (dbCapacity ? dbCapacity*2 : 256);
+		dbTiles = (BYTE *)realloc(dbTiles, dbCapacity*dbTileSize);
+		if (!dbTiles) error ("ERROR: Out of memory.");
+	}
+	memcpy (&dbTiles[dbCount*dbTileSize], data, dbTileSize);
+	rebuild_index (dbCount + 1);
+	dbIndex[find_slot(data)] = dbCount;
+	return dbCount++;
+}
+
+/*** load_database **********************************************************
+ * Loads the database file (if it exists) for tiles of 'tilesize' bytes.    *
+ ****************************************************************************/
+static void load_database(const char *filename, unsigned int tilesize){
+	BYTE header[TILEDB_HEADER_SIZE];
+	FILE *f;
+
+	if (dbTiles && !strcmp(dbFile, filename)){
+		if (dbTileSize != tilesize) error ("ERROR: Tile database %s holds %u byte tiles; can't mix 8x8 and 8x16 tiles in it.", filename, dbTileSize);
+		return;
+	}
+	tiledb_release ();
+	snprintf (dbFile, sizeof(dbFile), "%s", filename);
+	dbTileSize = tilesize;
+
+	f = fopen(filename, "rb");
+	if (f){
+		if (fread(header, 1, TILEDB_HEADER_SIZE, f) != TILEDB_HEADER_SIZE || memcmp(header, TILEDB_MAGIC, 8)) error ("ERROR: %s is not a PNGB tile database.", filename);
+		if (read_le32(&header[8]) != tilesize) error ("ERROR: Tile database %s holds %u byte tiles; can't mix 8x8 and 8x16 tiles in it.", filename, read_le32(&header[8]));
+		dbCount = dbCapacity = dbSaved = read_le32(&header[12]);
+	}
+	dbTiles = (BYTE *)malloc((dbCapacity ? dbCapacity : 1)*dbTileSize);
+	if (!dbTiles) error ("ERROR: Out of memory.");
+	if (f){
+		if (fread(dbTiles, dbTileSize, dbCount, f) != dbCount) error ("ERROR: Tile database %s is truncated.", filename);
+		fclose (f);
+	}
+	rebuild_index (dbCount);
+	verbose ("-- %u tiles loaded from %s\n", dbCount, filename);
+}
+
+/*** save_database **********************************************************
+ * Appends the tiles added since the last save to the database file, then   *
+ * updates the tile count. Tiles already in the file are never rewritten.   *
+ ****************************************************************************/
+static void save_database(void){
+	BYTE header[TILEDB_HEADER_SIZE];
+	FILE *f;
+
+	if (dbSaved == dbCount) return;
+	memcpy (header, TILEDB_MAGIC, 8);
+	write_le32 (&header[8], dbTileSize);
+	write_le32 (&header[12], dbCount);
+
+	f = fopen(dbFile, (dbSaved ? "r+b" : "wb"));
+	if (!f) error ("ERROR: Couldn't write the tile database %s", dbFile);
+	fseek (f, TILEDB_HEADER_SIZE + dbSaved*dbTileSize, SEEK_SET);
+	fwrite (&dbTiles[dbSaved*dbTileSize], dbTileSize, dbCount - dbSaved, f);
+	/* The count goes last, so an interrupted write only leaves unused tiles */
+	fseek (f, 0, SEEK_SET);
+	fwrite (header, 1, TILEDB_HEADER_SIZE, f);
+	fclose (f);
+	dbSaved = dbCount;
+}
+
+/*###########################################################################
+ ##                                                                        ##
+ ##                         T I L E   D A T A B A S E                      ##
+ ##                                                                        ##
+ ###########################################################################*/
+/*** tiledb_apply ***********************************************************
+ * Maps the tiles of a (reduced) picture to the tile database, adding the   *
+ * ones it doesn't have yet. The picture ends up with the whole database as *
+ * its tile set, and a tilemap that uses the database indexes.              *
+ ****************************************************************************/
+void tiledb_apply(PICDATA *pic, const char *filename){
+	unsigned int t, slot, old_count, *remap;
+	int c, mapsize = pic->cols*pic->rows, tdatasize = pic->tileh*2;
+	BYTE *data;
+
+	load_database (filename, tdatasize);
+	old_count = dbCount;
+
+	remap = (unsigned int *)arena_alloc(&jobArena, (pic->total_tiles ? pic->total_tiles : 1)*sizeof(unsigned int));
+	for (t=0; t<(unsigned int)pic->total_tiles; t++){
+		data = &pic->tiles[t*tdatasize];
+		slot = find_slot(data);
+		remap[t] = (dbIndex[slot] != TILE_EMPTY ? dbIndex[slot] : append_tile(data));
+	}
+	for (c=0; c<mapsize; c++){
+		if (pic->tilemap[c] != TILE_EMPTY) pic->tilemap[c] = remap[pic->tilemap[c]];
+	}
+	arena_free (remap);
+
+	pic->tiles = (BYTE *)arena_alloc(&jobArena, dbCount*tdatasize);
+	memcpy (pic->tiles, dbTiles, dbCount*tdatasize);
+	verbose ("-- %d tiles mapped, %u of them new. Database tile count: %u\n", pic->total_tiles, dbCount - old_count, dbCount);
+	pic->total_tiles = dbCount;
+	save_database ();
+}
+
+/*** tiledb_release *********************************************************
+ * Forgets the loaded database. Everything was already saved.               *
+ ****************************************************************************/
+void tiledb_release(void){
+	free (dbTiles);
+	free (dbIndex);
+	dbTiles		= NULL;
+	dbIndex		= NULL;
+	dbFile[0]	= '\0';
+	dbTileSize	= dbCount = dbCapacity = dbSaved = dbSlots = 0;
+}